@@ -0,0 +1,94 @@
+#!/bin/sh
+#
+# bench.sh: Measure the throughput of chd on synthetic corpora.
+#
+# Usage: bench.sh [CHD [BENCHGEN]]
+#
+# Each kind of corpus is generated once, and then dumped and
+# undumped, keeping the best time of several runs. The results are
+# written as JSON to the file named by BENCHOUT, and a summary is
+# shown on standard output. The environment variables BENCHSIZE (the
+# size of each corpus in bytes), BENCHRUNS (the number of runs of
+# each test), BENCHDIR (where the corpora are kept), BENCHLOCALE, and
+# BENCHFLAGS (extra options for chd) can be used to change the
+# defaults.
+
+chd=${1:-./chd}
+benchgen=${2:-./benchgen}
+size=${BENCHSIZE:-67108864}
+runs=${BENCHRUNS:-3}
+dir=${BENCHDIR:-bench.tmp}
+out=${BENCHOUT:-bench.json}
+LC_ALL=${BENCHLOCALE:-C.UTF-8}
+export LC_ALL
+
+mkdir -p "$dir" || exit 1
+
+# Run chd with the given arguments, discarding its output, and print
+# the best elapsed time in nanoseconds.
+besttime()
+{
+  best=
+  i=0
+  while [ $i -lt $runs ] ; do
+    start=$(date +%s%N)
+    "$chd" $BENCHFLAGS "$@" > /dev/null || exit 1
+    end=$(date +%s%N)
+    t=$((end - start))
+    if [ -z "$best" ] || [ $t -lt $best ] ; then best=$t ; fi
+    i=$((i + 1))
+  done
+  echo $best
+}
+
+# Append a result to the JSON output and the summary.
+report()
+{
+  awk -v corpus="$1" -v mode="$2" -v bytes="$3" -v chars="$4" -v ns="$5" \
+      -v sep="$sep" 'BEGIN {
+    s = ns / 1e9
+    if (s <= 0) s = 1e-9
+    printf "%s    { \"corpus\": \"%s\", \"mode\": \"%s\", \"bytes\": %d,", \
+	   sep, corpus, mode, bytes
+    printf " \"chars\": %d, \"seconds\": %.6f,", chars, s
+    printf " \"mb_per_s\": %.2f, \"chars_per_s\": %.0f }", \
+	   bytes / s / 1048576, chars / s
+  }' >> "$out.tmp"
+  awk -v corpus="$1" -v mode="$2" -v bytes="$3" -v chars="$4" -v ns="$5" \
+      'BEGIN {
+    s = ns / 1e9
+    if (s <= 0) s = 1e-9
+    printf "%-8s %-7s %10.2f MB/s %14.0f chars/s\n", \
+	   corpus, mode, bytes / s / 1048576, chars / s
+  }'
+  sep=",
+"
+}
+
+printf '{\n  "date": "%s",\n  "locale": "%s",\n  "size": %d,\n' \
+       "$(date -u +%Y-%m-%dT%H:%M:%SZ)" "$LC_ALL" $size > "$out.tmp"
+printf '  "runs": %d,\n  "flags": "%s",\n  "results": [\n' \
+       $runs "$BENCHFLAGS" >> "$out.tmp"
+sep=
+
+for kind in ascii cjk emoji invalid ; do
+  corpus="$dir/$kind.$size"
+  if [ ! -f "$corpus.chars" ] ; then
+    "$benchgen" $kind $size "$corpus" > "$corpus.chars" || exit 1
+  fi
+  chars=$(cat "$corpus.chars")
+  opts=
+  if [ $kind = invalid ] ; then opts=-i ; fi
+  "$chd" $opts "$corpus" > "$corpus.dump" || exit 1
+
+  t=$(besttime $opts "$corpus") || exit 1
+  report $kind dump $size $chars $t
+  dumpsize=$(wc -c < "$corpus.dump")
+  t=$(besttime -r "$corpus.dump") || exit 1
+  report $kind undump $dumpsize $chars $t
+  rm -f "$corpus.dump"
+done
+
+printf '\n  ]\n}\n' >> "$out.tmp"
+mv "$out.tmp" "$out"
+echo "results written to $out"
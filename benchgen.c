@@ -0,0 +1,164 @@
+/*
+ * benchgen.c: Generate synthetic input files for benchmarking chd.
+ *
+ * Copyright (C) 2013-2017 Brian Raiter <breadbox@muppetlabs.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The usage message.
+ */
+static char const *usage =
+    "Usage: benchgen KIND SIZE FILE\n"
+    "Write SIZE bytes of synthetic UTF-8 text to FILE, and output the\n"
+    "number of characters written (as chd -i would count them).\n"
+    "KIND is one of:\n"
+    "  ascii    printable ASCII text\n"
+    "  cjk      mostly CJK ideographs, with some ASCII\n"
+    "  emoji    mostly characters outside the BMP, with some ASCII\n"
+    "  invalid  ASCII text including stray bytes that are not UTF-8\n";
+
+/* The state of the pseudorandom number generator. A fixed seed is
+ * used so that every run produces the same corpus.
+ */
+static unsigned long long rngstate = 0x9E3779B97F4A7C15ULL;
+
+/* Return a pseudorandom number less than n (xorshift64*).
+ */
+static unsigned int rnd(unsigned int n)
+{
+    rngstate ^= rngstate >> 12;
+    rngstate ^= rngstate << 25;
+    rngstate ^= rngstate >> 27;
+    return ((rngstate * 0x2545F4914F6CDD1DULL) >> 32) % n;
+}
+
+/* Store the UTF-8 encoding of ch at p and return its length.
+ */
+static int encode(unsigned char *p, unsigned long ch)
+{
+    if (ch < 0x80) {
+	p[0] = ch;
+	return 1;
+    } else if (ch < 0x800) {
+	p[0] = 0xC0 | (ch >> 6);
+	p[1] = 0x80 | (ch & 0x3F);
+	return 2;
+    } else if (ch < 0x10000) {
+	p[0] = 0xE0 | (ch >> 12);
+	p[1] = 0x80 | ((ch >> 6) & 0x3F);
+	p[2] = 0x80 | (ch & 0x3F);
+	return 3;
+    } else {
+	p[0] = 0xF0 | (ch >> 18);
+	p[1] = 0x80 | ((ch >> 12) & 0x3F);
+	p[2] = 0x80 | ((ch >> 6) & 0x3F);
+	p[3] = 0x80 | (ch & 0x3F);
+	return 4;
+    }
+}
+
+/* Store the next character of the given kind of corpus at p, and
+ * return its length in bytes. col is the current column, used to
+ * break the text into lines. The number of characters stored is
+ * returned in *count.
+ */
+static int nextchar(char const *kind, unsigned char *p, int col, int *count)
+{
+    *count = 1;
+    if (col >= 60 && !rnd(8)) {
+	*p = '\n';
+	return 1;
+    }
+    if (!strcmp(kind, "cjk") && rnd(8))
+	return encode(p, 0x4E00 + rnd(0x5200));
+    if (!strcmp(kind, "emoji") && rnd(8))
+	return encode(p, 0x1F300 + rnd(0x300));
+    if (!strcmp(kind, "invalid") && !rnd(16)) {
+	/* A lone continuation byte or an always-invalid byte, followed
+	 * by ASCII so that it cannot start a valid sequence. */
+	p[0] = rnd(3) ? 0x80 + rnd(0x40) : 0xFE + rnd(2);
+	p[1] = 'a' + rnd(26);
+	*count = 2;
+	return 2;
+    }
+    *p = rnd(6) ? 'a' + rnd(26) : ' ';
+    return 1;
+}
+
+/* Generate the corpus.
+ */
+int main(int argc, char *argv[])
+{
+    unsigned char  buf[65536 + 8];
+    unsigned long long size, written, chars;
+    FILE          *fp;
+    char          *p;
+    int            col, len, count, n;
+
+    if (argc != 4)
+	goto badusage;
+    if (strcmp(argv[1], "ascii") && strcmp(argv[1], "cjk")
+				  && strcmp(argv[1], "emoji")
+				  && strcmp(argv[1], "invalid"))
+	goto badusage;
+    size = strtoull(argv[2], &p, 0);
+    if (*p != '\0' || p == argv[2])
+	goto badusage;
+    fp = fopen(argv[3], "wb");
+    if (!fp) {
+	perror(argv[3]);
+	return EXIT_FAILURE;
+    }
+
+    written = chars = 0;
+    col = len = 0;
+    while (written < size) {
+	n = nextchar(argv[1], buf + len, col, &count);
+	if (written + len + n > size) {
+	    /* Pad the end with newlines to reach the exact size. */
+	    n = count = size - written - len;
+	    memset(buf + len, '\n', n);
+	}
+	col = buf[len] == '\n' ? 0 : col + count;
+	chars += count;
+	len += n;
+	if (len >= 65536 || written + len == size) {
+	    fwrite(buf, len, 1, fp);
+	    written += len;
+	    len = 0;
+	}
+    }
+    if (ferror(fp) | fclose(fp)) {
+	perror(argv[3]);
+	return EXIT_FAILURE;
+    }
+    printf("%llu\n", chars);
+    return EXIT_SUCCESS;
+
+  badusage:
+    fputs(usage, stderr);
+    return EXIT_FAILURE;
+}
@@ -24,21 +24,28 @@
  * SOFTWARE.
  */
 
-#define _XOPEN_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
 #include <limits.h>
-#include <wchar.h>
 #include <locale.h>
 #include <errno.h>
 #include <getopt.h>
-
-static int const ctlpics = 0x2400;	/* Unicode control pics start */
-static int const replacechar = 0xFFFD;	/* Unicode replacement character */
-static int const rawbyte = 0x10000000;	/* flag indicating a raw byte value */
+#include <wchar.h>
+#include <signal.h>
+#include <termios.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "chd.h"
+
+/* The pager is selected by a mode of the program's own, besides the
+ * operations of the library.
+ */
+enum { modepage = -1 };
 
 /* Online help.
  */
@@ -49,11 +56,29 @@ static char const *yowzitch =
     "the files' contents are concatenated together. With no arguments, or\n"
     "when FILENAME is -, read from standard input.\n"
     "\n"
+    "  -a, --autoskip        Replace runs of identical lines with a '*'\n"
+    "  -C, --context=N       With --match, also show N lines around each\n"
     "  -c, --count=N         Display N characters per line [default=8]\n"
+    "  -f, --follow          Keep waiting for the last file to grow\n"
     "  -i, --ignore          Treat invalid characters as individual bytes\n"
+    "  -j, --jobs=N          Use N threads for large files [0=all CPUs]\n"
     "  -s, --start=N         Start N characters after start of input\n"
     "  -l, --limit=N         Stop after N characters of input\n"
     "  -r, --reverse         Reverse operation: convert dump output to chars\n"
+    "      --build-index     Create index files to speed up --start\n"
+    "      --encoding=NAME   Decode input as NAME instead of the locale's\n"
+    "      --extract         Output the input bytes selected by --start/--limit\n"
+    "      --format=FMT      Output a dump as text, bin, jsonl or csv\n"
+    "                        [default=text]\n"
+    "      --latency=MS      With --follow, show partial lines after MS ms\n"
+    "      --match=LIST      Only show lines with characters in LIST, such as\n"
+    "                        U+200B-U+200F,U+FEFF (or raw, or nonascii)\n"
+    "      --no-decompress   Dump compressed input files as they are\n"
+    "      --no-mmap         Read input files instead of mapping them\n"
+    "      --page            Browse the dump of a file interactively\n"
+    "      --scan            Count each character instead of dumping them\n"
+    "      --separate        Dump each file separately, under a header\n"
+    "      --stats           Display statistics on stderr when done\n"
     "      --help            Display this help and exit\n"
     "      --version         Display version information and exit\n";
 
@@ -65,36 +90,9 @@ static char const *vourzhon =
     "This is free software; you are free to change and redistribute it.\n"
     "There is NO WARRANTY, to the extent permitted by law.\n";
 
-/* The program's input file state and user-controlled settings.
- */
-typedef struct state {
-    int startoffset;	/* skip over this many chars of input at start */
-    int maxinputlen;	/* stop after this many chars of input */
-    char **filenames;	/* NULL-terminated list of input filenames */
-    FILE *currentfile;	/* handle to the currently open input file */
-} state;
-
-/* Number of characters to display per line of dump output. (The
- * default value is 8, which produces output that fits comfortably on
- * an 80-column display.)
- */
-static int linesize = 8;
-
-/* If nonzero, treat invalid sequences as raw bytes (octets).
- */
-static int acceptbadchars = 0;
-
-/* The program's (eventual) exit code.
- */
-static int exitcode = 0;
-
-/*
- * Basic functions.
- */
-
 /* Display a formatted message on stderr and exit.
  */
-void die(char const *fmt, ...)
+static void die(char const *fmt, ...)
 {
     va_list args;
     va_start(args, fmt);
@@ -104,307 +102,652 @@ void die(char const *fmt, ...)
     exit(EXIT_FAILURE);
 }
 
-/* Display an error message for the current file and set the exit code.
- */
-static void fail(state *s)
-{
-    perror(s->filenames && *s->filenames ? *s->filenames : "chd");
-    exitcode = EXIT_FAILURE;
-}
-
-/* Read a small non-negative integer from a string. Exit with a
- * simple error message if the string is not a valid number, or if
- * the number hits a given upper limit.
+/* Read a non-negative integer from a string. Exit with a simple
+ * error message if the string is not a valid number, or if the number
+ * hits a given upper limit.
  */
-static int getn(char const *str, char const *name, int maxval)
+static long long getn(char const *str, char const *name, long long maxval)
 {
-    char *p;
-    long n;
+    char     *p;
+    long long n;
 
     if (!str || !*str)
 	die("missing argument for %s", name);
-    n = strtol(str, &p, 0);
-    if (*p != '\0' || p == str ||
-		(n == LONG_MAX && errno == ERANGE) || n < 0 || n > INT_MAX)
+    errno = 0;
+    n = strtoll(str, &p, 0);
+    if (*p != '\0' || p == str || errno == ERANGE || n < 0)
 	die("invalid argument '%s' for %s", str, name);
     if (maxval && n > maxval)
-	die("value for %s too large (maximum %d)", name, maxval);
+	die("value for %s too large (maximum %lld)", name, maxval);
     return n;
 }
 
-/*
- * File I/O.
+/* Return the output format named by str. An invalid name will cause
+ * the program to terminate.
  */
+static int getformat(char const *str)
+{
+    if (!strcmp(str, "text"))
+	return CHD_FORMAT_TEXT;
+    if (!strcmp(str, "bin"))
+	return CHD_FORMAT_BIN;
+    if (!strcmp(str, "jsonl"))
+	return CHD_FORMAT_JSONL;
+    if (!strcmp(str, "csv"))
+	return CHD_FORMAT_CSV;
+    die("invalid argument '%s' for format (must be text, bin, jsonl or csv)",
+	str);
+    return -1;
+}
 
-/* Prepare the current input file, if necessary. (Does nothing if the
- * current input file is already open and is not at the end.) Any
- * errors that occur when opening a file are reported to stderr before
- * moving on to the next input file. The return value is zero if no
- * more input files are available.
+/* Return the option that selects the given mode (other than dumping).
  */
-static int inputinit(state *s)
+static char const *modeoption(int mode)
 {
-    if (!s->currentfile) {
-	if (!*s->filenames)
-	    return 0;
-	if (!strcmp(*s->filenames, "-")) {
-	    s->currentfile = stdin;
-	    *s->filenames = "stdin";
-	} else {
-	    s->currentfile = fopen(*s->filenames, "r");
-	}
-	if (!s->currentfile) {
-	    fail(s);
-	    ++s->filenames;
-	    return inputinit(s);
-	}
+    switch (mode) {
+      case CHD_UNDUMP:	return "--reverse";
+      case CHD_INDEX:	return "--build-index";
+      case CHD_EXTRACT:	return "--extract";
+      case CHD_SCAN:	return "--scan";
     }
-    return 1;
+    return "--page";
 }
 
-/* Close the current input file, reporting errors if any to stderr.
+/* Return the mode selected by an option, given the mode selected so
+ * far. Selecting a different mode from an earlier option will cause
+ * the program to terminate.
  */
-static void inputupdate(state *s)
+static int getmode(int mode, int newmode)
 {
-    if (ferror(s->currentfile)) {
-	fail(s);
-	fclose(s->currentfile);
-    } else {
-	if (s->currentfile != stdin)
-	    if (fclose(s->currentfile))
-		fail(s);
-    }
-    s->currentfile = 0;
-    ++s->filenames;
+    if (mode != CHD_DUMP && mode != newmode)
+	die("%s cannot be used with %s", modeoption(newmode), modeoption(mode));
+    return newmode;
 }
 
-/* Get the next character from the current file. If there are no more
- * characters in the current file, open the next file in the list of
- * filenames and get a character from that. If there are no more
- * filenames, return WEOF. If an invalid byte sequence is encountered
- * and acceptbadchars is true, then a single byte is retrieved from
- * the current file, and the return value is the the value of the
- * octet ORed with the rawbyte flag.
+/* Read a codepoint, written in hexadecimal with an optional U+
+ * prefix, from the start of a string. The return value points to the
+ * rest of the string, or is NULL if no valid codepoint is present.
  */
-static wchar_t nextwchar(state *s)
+static char const *getcodepoint(char const *str, long *pch)
 {
-    wint_t  ch;
+    char *p;
 
-    for (;;) {
-	if (!inputinit(s))
-	    return WEOF;
-	ch = fgetwc(s->currentfile);
-	if (ch != WEOF)
-	    return ch;
-	if (ferror(s->currentfile) && errno == EILSEQ && acceptbadchars) {
-	    clearerr(s->currentfile);
-	    return rawbyte | fgetc(s->currentfile);
+    if ((str[0] == 'U' || str[0] == 'u') && str[1] == '+')
+	str += 2;
+    if (!isxdigit((unsigned char)*str))
+	return NULL;
+    errno = 0;
+    *pch = strtol(str, &p, 16);
+    if (errno == ERANGE || *pch > 0x10FFFF)
+	return NULL;
+    return p;
+}
+
+/* Store the characters selected by --match in the settings. The
+ * argument is a comma-separated list of codepoints and ranges of
+ * codepoints, and of the names "raw", for any raw byte, and
+ * "nonascii", for every character outside of ASCII. The list replaces
+ * any given earlier. An invalid list will cause the program to
+ * terminate.
+ */
+static void getmatch(char const *str, chd_options *opts)
+{
+    chd_range  *ranges;
+    char const *p, *q;
+    size_t      len;
+    int         n;
+
+    n = 1;
+    for (p = str ; *p ; ++p)
+	n += *p == ',';
+    ranges = realloc((chd_range*)opts->match, n * sizeof *ranges);
+    if (!ranges)
+	die("out of memory");
+    opts->match = ranges;
+    opts->matchcount = 0;
+    opts->matchraw = 0;
+    for (p = str ; ; p += len + 1) {
+	len = strcspn(p, ",");
+	if (len == 3 && !strncmp(p, "raw", 3)) {
+	    opts->matchraw = 1;
+	} else if (len == 8 && !strncmp(p, "nonascii", 8)) {
+	    ranges[opts->matchcount].first = 0x80;
+	    ranges[opts->matchcount++].last = 0x10FFFF;
+	} else {
+	    q = getcodepoint(p, &ranges[opts->matchcount].first);
+	    if (q && *q == '-')
+		q = getcodepoint(q + 1, &ranges[opts->matchcount].last);
+	    else
+		ranges[opts->matchcount].last = ranges[opts->matchcount].first;
+	    if (q != p + len || ranges[opts->matchcount].last
+				< ranges[opts->matchcount].first)
+		die("invalid argument '%s' for match", str);
+	    ++opts->matchcount;
 	}
-	inputupdate(s);
+	if (!p[len])
+	    break;
     }
 }
 
-/* Get a line of text from the current file and store it in buf.
- * Return zero if no further input is available.
+/* Parse the command-line arguments and fill in the settings and the
+ * list of input files appropriately. Invalid arguments will cause the
+ * program to terminate. The return value indicates which operation
+ * the user requested.
  */
-static int nextwline(state *s, wchar_t *buf, int buflen)
+static int parsecommandline(int argc, char *argv[], chd_options *opts,
+			    char ***pfilenames)
 {
-    for (;;) {
-	if (!inputinit(s))
-	    return 0;
-	if (fgetws(buf, buflen, s->currentfile))
-	    return 1;
-	inputupdate(s);
+    static char *defaultargs[] = { "-", NULL };
+    static char const *optstring = "aC:c:fij:l:rs:";
+    static struct option options[] = {
+	{ "autoskip", no_argument, NULL, 'a' },
+	{ "count", required_argument, NULL, 'c' },
+	{ "limit", required_argument, NULL, 'l' },
+	{ "start", required_argument, NULL, 's' },
+	{ "jobs", required_argument, NULL, 'j' },
+	{ "follow", no_argument, NULL, 'f' },
+	{ "latency", required_argument, NULL, 'L' },
+	{ "ignore", no_argument, NULL, 'i' },
+	{ "reverse", no_argument, NULL, 'r' },
+	{ "build-index", no_argument, NULL, 'x' },
+	{ "extract", no_argument, NULL, 'X' },
+	{ "format", required_argument, NULL, 'F' },
+	{ "encoding", required_argument, NULL, 'E' },
+	{ "no-decompress", no_argument, NULL, 'Z' },
+	{ "no-mmap", no_argument, NULL, 'M' },
+	{ "page", no_argument, NULL, 'p' },
+	{ "scan", no_argument, NULL, 'K' },
+	{ "match", required_argument, NULL, 'm' },
+	{ "context", required_argument, NULL, 'C' },
+	{ "separate", no_argument, NULL, 'P' },
+	{ "stats", no_argument, NULL, 'S' },
+	{ "help", no_argument, NULL, 'h' },
+	{ "version", no_argument, NULL, 'v' },
+	{ 0, 0, 0, 0 }
+    };
+
+    int mode = CHD_DUMP;
+    int ch;
+
+    chd_defaults(opts);
+    *pfilenames = defaultargs;
+
+    while ((ch = getopt_long(argc, argv, optstring, options, NULL)) != EOF) {
+	switch (ch) {
+	  case 'l':	opts->limit = getn(optarg, "limit", 0);	    break;
+	  case 's':	opts->start = getn(optarg, "start", 0);	    break;
+	  case 'c':	opts->count = getn(optarg, "count", CHD_MAXCOUNT); break;
+	  case 'i':	opts->ignore = 1;			    break;
+	  case 'a':	opts->autoskip = 1;			    break;
+	  case 'f':	opts->follow = 1;			    break;
+	  case 'L':
+	    opts->latency = getn(optarg, "latency", INT_MAX);
+	    break;
+	  case 'j':	opts->jobs = getn(optarg, "jobs", 1024);    break;
+	  case 'r':	mode = getmode(mode, CHD_UNDUMP);	    break;
+	  case 'x':	mode = getmode(mode, CHD_INDEX);	    break;
+	  case 'X':	mode = getmode(mode, CHD_EXTRACT);	    break;
+	  case 'F':	opts->format = getformat(optarg);	    break;
+	  case 'E':	opts->encoding = optarg;		    break;
+	  case 'M':	opts->usemmap = 0;			    break;
+	  case 'Z':	opts->decompress = 0;			    break;
+	  case 'p':	mode = getmode(mode, modepage);		    break;
+	  case 'K':	mode = getmode(mode, CHD_SCAN);		    break;
+	  case 'm':	getmatch(optarg, opts);			    break;
+	  case 'C':	opts->context = getn(optarg, "context", 1024); break;
+	  case 'P':	opts->separate = 1;			    break;
+	  case 'S':	opts->stats = 1;			    break;
+	  case 'h':	fputs(yowzitch, stdout);		    exit(0);
+	  case 'v':	fputs(vourzhon, stdout);		    exit(0);
+	  default:	die("Try --help for more information.");
+	}
+    }
+    if (optind < argc)
+	*pfilenames = argv + optind;
+    if (opts->count < 1)
+	die("invalid argument '0' for count");
+    if (opts->follow && mode != CHD_DUMP && mode != CHD_UNDUMP)
+	die("--follow cannot be used with --build-index, --extract or --scan");
+    if (opts->separate && (mode != CHD_DUMP || opts->follow))
+	die("--separate can only be used to dump files, without --follow");
+    if (opts->separate && (opts->format == CHD_FORMAT_JSONL
+			   || opts->format == CHD_FORMAT_CSV))
+	die("--separate cannot be used with --format=jsonl or --format=csv");
+    if (opts->format != CHD_FORMAT_DEFAULT && mode != CHD_DUMP
+					   && mode != CHD_UNDUMP)
+	die("--format cannot be used with --build-index, --extract or --scan");
+    if (opts->autoskip && opts->format != CHD_FORMAT_DEFAULT
+		       && opts->format != CHD_FORMAT_TEXT)
+	die("--autoskip can only be used with --format=text");
+    if (opts->matchcount || opts->matchraw) {
+	if (mode != CHD_DUMP)
+	    die("--match can only be used when dumping");
+	if (opts->autoskip)
+	    die("--match cannot be used with --autoskip");
+	if (opts->format != CHD_FORMAT_DEFAULT
+			&& opts->format != CHD_FORMAT_TEXT)
+	    die("--match can only be used with --format=text");
+    } else if (opts->context) {
+	die("--context can only be used with --match");
     }
+    if (mode == modepage) {
+	if (opts->autoskip || opts->follow || opts->separate
+			   || opts->format == CHD_FORMAT_BIN
+			   || opts->limit != LLONG_MAX)
+	    die("--page cannot be used with --autoskip, --follow, --format=bin,"
+		" --limit or --separate");
+	if (optind + 1 != argc || !strcmp(argv[optind], "-"))
+	    die("--page requires a single input file");
+    }
+
+    return mode;
 }
 
-/*
- * Dump format functions.
+/* The keys recognized by the pager, besides ordinary characters.
  */
+enum { keynone = -1, keyup = 256, keydown, keypageup, keypagedown,
+       keyhome, keyend, keyeof };
 
-/* Output one line of data as a hexdump, containing up to linesize
- * characters. pos supplies the current file position.
+/* The state of the pager.
+ */
+typedef struct pager {
+    chd_context *ctx;		/* the context producing the dump */
+    char const *filename;	/* the file being viewed */
+    int tty;			/* descriptor of the terminal */
+    int count;			/* characters per line of the dump */
+    int rows;			/* lines of the dump that fit on the screen */
+    int shown;			/* lines of the dump on the screen */
+    long long top;		/* offset of the first character shown */
+    long long length;		/* characters in the file, or -1 if unknown */
+    long long match;		/* offset of the last match, or -1 */
+    wchar_t pattern[256];	/* the last string searched for */
+    size_t patternlen;		/* number of characters in pattern */
+    char message[256];		/* message for the status line, if any */
+} pager;
+
+static struct termios savedterm;	/* the terminal's original settings */
+static int savedtty = -1;		/* the terminal while it is in use */
+static volatile sig_atomic_t resized;	/* true when the window changes */
+
+/* Write size bytes at buf to the terminal. The return value is zero
+ * on success, or -1 if the terminal cannot be written to.
  */
-static void renderdumpline(wchar_t const *buf, int count, int pos)
+static int ttywrite(int tty, char const *buf, size_t size)
 {
-    int i;
-
-    wprintf(L"%08X: ", pos);
-    for (i = 0 ; i < count ; ++i) {
-	if (buf[i] < 256)
-	    wprintf(L"    %02X", buf[i]);
-	else if (buf[i] & rawbyte)
-	    wprintf(L"   *%02X", buf[i] & 0xFF);
-	else
-	    wprintf(L"%6X", buf[i]);
+    ssize_t n;
+
+    while (size) {
+	n = write(tty, buf, size);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return -1;
+	buf += n;
+	size -= n;
     }
-    wprintf(L"%*s", 6 * (linesize - count) + 5, "");
-    for (i = 0 ; i < count ; ++i) {
-	switch (wcwidth(buf[i])) {
-	  case 2:
-	    putwchar(buf[i]);
-	    break;
-	  case 1:
-	    putwchar(buf[i]);
-	    putwchar(L' ');
-	    break;
-	  default:
-	    if (buf[i] < 0x20)
-		putwchar(ctlpics + buf[i]);
-	    else
-		putwchar(replacechar);
-	    putwchar(L' ');
-	    break;
-	}
-    }
-    putwchar(L'\n');
+    return 0;
 }
 
-/* Parse input as a line of dumped data and output the characters
- * represented therein. Return the number of characters output. If
- * line is NULL, the function resets stdout's shift state. (Because
- * the output may need to include embedded raw bytes, wcrtomb() is
- * used to translate characters into byte sequences instead of using
- * putwchar() directly.)
+/* Write a string to the terminal.
  */
-static int translatedumpline(wchar_t *line)
+static void ttyputs(int tty, char const *str)
 {
-    static mbstate_t mbs;
+    ttywrite(tty, str, strlen(str));
+}
 
-    char     out[MB_CUR_MAX + 1];
-    wchar_t *p;
-    int      ch, i, n;
+/* Return the terminal to its original settings and screen. (Called on
+ * exit, and by the handler of signals that end the program.)
+ */
+static void restoreterminal(void)
+{
+    static char const reset[] = "\033[?7h\033[?1049l";
 
-    if (!line) {
-	fwrite(out, wcrtomb(out, L'\0', &mbs) - 1, 1, stdout);
-	return 0;
+    if (savedtty >= 0) {
+	ttywrite(savedtty, reset, sizeof reset - 1);
+	tcsetattr(savedtty, TCSANOW, &savedterm);
+	savedtty = -1;
     }
+}
 
-    for (p = line ; *p != L'\0' && *p != L' ' ; ++p) ;
-    if (!*p)
-	return 0;
-    ++p;
-    for (i = 0 ; i < linesize ; ++i) {
-	if (swscanf(p, L"%6X", &ch) == 1) {
-	    n = wcrtomb(out, ch, &mbs);
-	    if (n < 0)
-		n = wcrtomb(out, replacechar, &mbs);
-	    fwrite(out, n, 1, stdout);
-	} else if (swscanf(p, L" *%2X", &ch) == 1) {
-	    n = wcrtomb(out, L'\0', &mbs);
-	    out[n - 1] = ch;
-	    fwrite(out, n, 1, stdout);
-	} else {
-	    break;
-	}
-	p += 6;
-    }
-    return i;
+/* Restore the terminal and then die of the signal.
+ */
+static void onsignal(int sig)
+{
+    restoreterminal();
+    signal(sig, SIG_DFL);
+    raise(sig);
 }
 
-/*
- * The main program functions.
+/* Note that the window has changed size.
  */
+static void onresize(int sig)
+{
+    (void)sig;
+    resized = 1;
+}
 
-/* Display hexdump lines from the given filenames until there's no
- * more input.
+/* Receive the dump of the visible lines, counting them as they are
+ * sent on to the terminal.
  */
-static void dump(state *s)
+static int pagewrite(void *arg, char const *buf, size_t size)
 {
-    wchar_t line[256];
-    wint_t  ch = 0;
-    int     pos = 0;
-    int     n;
-
-    for (pos = 0 ; ch != WEOF && pos < s->startoffset ; ++pos)
-	ch = nextwchar(s);
-
-    while (ch != WEOF && s->maxinputlen > 0) {
-	for (n = 0 ; n < linesize && s->maxinputlen > 0 ; ++n) {
-	    ch = nextwchar(s);
-	    if (ch == WEOF)
-		break;
-	    line[n] = ch;
-	    --s->maxinputlen;
+    pager *pg = arg;
+    size_t i;
+
+    for (i = 0 ; i < size ; ++i)
+	pg->shown += buf[i] == '\n';
+    return ttywrite(pg->tty, buf, size);
+}
+
+/* Return true if the end of the file is on the screen.
+ */
+static int atend(pager const *pg)
+{
+    return pg->shown < pg->rows
+	|| (pg->length >= 0
+		&& pg->top + (long long)pg->rows * pg->count >= pg->length);
+}
+
+/* Move the top of the screen to the line containing the given offset,
+ * or to the last line if the offset is known to be past the end.
+ */
+static void movetop(pager *pg, long long pos)
+{
+    if (pg->length > 0 && pos >= pg->length)
+	pos = pg->length - 1;
+    pg->top = pos < 0 ? 0 : pos - pos % pg->count;
+}
+
+/* Show a line of text in reverse video on the bottom line of the
+ * screen.
+ */
+static void showstatus(pager const *pg, char const *text)
+{
+    char buf[64];
+
+    sprintf(buf, "\033[%d;1H\033[7m", pg->rows + 1);
+    ttyputs(pg->tty, buf);
+    ttyputs(pg->tty, text);
+    ttyputs(pg->tty, "\033[m\033[K");
+}
+
+/* Fill the screen with the lines of the dump from the top offset on,
+ * which are all that is decoded, followed by the status line.
+ */
+static void redraw(pager *pg)
+{
+    struct winsize ws;
+    char           status[512];
+
+    pg->rows = 23;
+    if (!ioctl(pg->tty, TIOCGWINSZ, &ws) && ws.ws_row > 1)
+	pg->rows = ws.ws_row - 1;
+    ttyputs(pg->tty, "\033[H\033[J");
+    pg->shown = 0;
+    chd_dumprange(pg->ctx, pg->filename, pg->top,
+		  (long long)pg->rows * pg->count);
+    if (*pg->message)
+	snprintf(status, sizeof status, "%s", pg->message);
+    else if (atend(pg))
+	snprintf(status, sizeof status, "%s  %08llX  (END)",
+		 pg->filename, pg->top);
+    else if (pg->length > 0)
+	snprintf(status, sizeof status, "%s  %08llX  %lld%%",
+		 pg->filename, pg->top,
+		 (pg->top + (long long)pg->rows * pg->count) * 100 / pg->length);
+    else
+	snprintf(status, sizeof status, "%s  %08llX", pg->filename, pg->top);
+    showstatus(pg, status);
+    *pg->message = '\0';
+}
+
+/* Wait for a keypress and return it. The escape sequences of the
+ * cursor keys are translated into the pager's own key values.
+ * keynone is returned if the window changed size while waiting, and
+ * keyeof if the terminal cannot be read.
+ */
+static int readkey(int tty)
+{
+    struct pollfd pfd;
+    unsigned char c, seq[3];
+    int           n;
+
+    n = read(tty, &c, 1);
+    if (n < 0 && errno == EINTR)
+	return keynone;
+    if (n <= 0)
+	return keyeof;
+    if (c != '\033')
+	return c;
+    pfd.fd = tty;
+    pfd.events = POLLIN;
+    for (n = 0 ; n < 3 ; ++n) {
+	if (poll(&pfd, 1, 50) <= 0 || read(tty, seq + n, 1) != 1)
+	    return '\033';
+	if (n > 0 && seq[n] != '[' && (seq[n] < '0' || seq[n] > '9'))
+	    break;
+    }
+    if (n == 3 || (seq[0] != '[' && seq[0] != 'O'))
+	return keynone;
+    switch (seq[n]) {
+      case 'A':	return n == 1 ? keyup : keynone;
+      case 'B':	return n == 1 ? keydown : keynone;
+      case 'H':	return n == 1 ? keyhome : keynone;
+      case 'F':	return n == 1 ? keyend : keynone;
+      case '~':
+	switch (seq[1]) {
+	  case '1': case '7':	return keyhome;
+	  case '4': case '8':	return keyend;
+	  case '5':		return keypageup;
+	  case '6':		return keypagedown;
 	}
-	if (n)
-	    renderdumpline(line, n, pos);
-	pos += n;
     }
+    return keynone;
 }
 
-/* Input dump lines and turn them into character output.
+/* Read a line of input in place of the status line, following the
+ * given label. (The line is not redrawn while a character has only
+ * partly been typed.) The return value is false if the input is
+ * cancelled by pressing escape.
  */
-static void undump(state *s)
+static int prompt(pager *pg, char const *label, char *buf, int size)
 {
-    wchar_t  *line;
-    int       len;
-
-    len = linesize * 8 + 20;
-    line = malloc(len * 4);
-    while (nextwline(s, line, len) && s->maxinputlen > 0)
-	s->maxinputlen -= translatedumpline(line);
-    translatedumpline(NULL);
-    free(line);
+    char line[64];
+    int  len, key;
+
+    len = 0;
+    buf[0] = '\0';
+    for (;;) {
+	if (mbstowcs(NULL, buf, 0) != (size_t)-1) {
+	    sprintf(line, "\033[%d;1H\033[K", pg->rows + 1);
+	    ttyputs(pg->tty, line);
+	    ttyputs(pg->tty, label);
+	    ttyputs(pg->tty, buf);
+	}
+	key = readkey(pg->tty);
+	if (key == '\r' || key == '\n')
+	    return 1;
+	if (key == '\033' || key == keyeof)
+	    return 0;
+	if ((key == 127 || key == '\b') && len) {
+	    do
+		--len;
+	    while (len && MB_CUR_MAX > 1 && (buf[len] & 0xC0) == 0x80);
+	    buf[len] = '\0';
+	} else if (key >= ' ' && key < 256 && len < size - 1) {
+	    buf[len++] = key;
+	    buf[len] = '\0';
+	}
+    }
 }
 
-/* Parse the command-line arguments and initialize the given state
- * appropriately. Invalid arguments will cause the program to
- * terminate. The return value is true if the user requested a normal
- * dump, or zero if the program should translate dump input back into
- * literal characters.
+/* Search forward from the given offset for the last string searched
+ * for, and bring the line containing it to the top of the screen.
  */
-static int parsecommandline(int argc, char *argv[], state *s)
+static void findnext(pager *pg, long long from)
 {
-    static char *defaultargs[] = { "-", NULL };
-    static char const *optstring = "c:il:rs:";
-    static struct option options[] = {
-	{ "count", required_argument, NULL, 'c' },
-	{ "limit", required_argument, NULL, 'l' },
-	{ "start", required_argument, NULL, 's' },
-	{ "ignore", no_argument, NULL, 'i' },
-	{ "reverse", no_argument, NULL, 'r' },
-	{ "help", no_argument, NULL, 'h' },
-	{ "version", no_argument, NULL, 'v' },
-	{ 0, 0, 0, 0 }
-    };
+    long long pos;
 
-    int forward = 1;
-    int ch;
+    if (!pg->patternlen) {
+	strcpy(pg->message, "No previous search");
+	return;
+    }
+    showstatus(pg, "Searching...");
+    pos = chd_search(pg->ctx, pg->filename, from,
+		     pg->pattern, pg->patternlen);
+    if (pos < 0) {
+	strcpy(pg->message, "Pattern not found");
+	return;
+    }
+    pg->match = pos;
+    movetop(pg, pos);
+    sprintf(pg->message, "Match at %08llX", pos);
+}
 
-    s->startoffset = 0;
-    s->maxinputlen = INT_MAX;
-    s->filenames = defaultargs;
-    s->currentfile = NULL;
+/* Browse the dump of a file on the terminal, rendering only the lines
+ * that are visible, so that the file can be of any size. Commands are
+ * single keys, in the manner of less(1).
+ */
+static int page(chd_context *ctx, chd_options const *opts,
+		char const *filename)
+{
+    struct termios   term;
+    struct sigaction sa;
+    pager            pg;
+    char             buf[1024];
+    char            *end;
+    long long        n;
+    size_t           len;
+    int              pagelen, key;
+
+    pg.tty = open("/dev/tty", O_RDWR);
+    if (pg.tty < 0 || tcgetattr(pg.tty, &savedterm))
+	die("--page requires a terminal");
+    pg.ctx = ctx;
+    pg.filename = filename;
+    pg.count = opts->count;
+    pg.rows = 23;
+    pg.shown = 0;
+    pg.length = chd_length(ctx, filename);
+    pg.match = -1;
+    pg.patternlen = 0;
+    *pg.message = '\0';
+    movetop(&pg, opts->start);
+
+    term = savedterm;
+    term.c_lflag &= ~(ICANON | ECHO);
+    term.c_cc[VMIN] = 1;
+    term.c_cc[VTIME] = 0;
+    savedtty = pg.tty;
+    atexit(restoreterminal);
+    memset(&sa, 0, sizeof sa);
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = onsignal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    sa.sa_handler = onresize;
+    sigaction(SIGWINCH, &sa, NULL);
+    tcsetattr(pg.tty, TCSAFLUSH, &term);
+    ttyputs(pg.tty, "\033[?1049h\033[?7l");
+    chd_setoutput(ctx, pagewrite, &pg);
 
-    while ((ch = getopt_long(argc, argv, optstring, options, NULL)) != EOF) {
-	switch (ch) {
-	  case 'l':	s->maxinputlen = getn(optarg, "limit", 0);  break;
-	  case 's':	s->startoffset = getn(optarg, "start", 0);  break;
-	  case 'c':	linesize = getn(optarg, "count", 255);	    break;
-	  case 'i':	acceptbadchars = 1;			    break;
-	  case 'r':	forward = 0;				    break;
-	  case 'h':	fputs(yowzitch, stdout);		    exit(0);
-	  case 'v':	fputs(vourzhon, stdout);		    exit(0);
-	  default:	die("Try --help for more information.");
+    for (;;) {
+	resized = 0;
+	redraw(&pg);
+	pagelen = pg.rows * pg.count;
+	key = keynone;
+	while (key == keynone && !resized)
+	    key = readkey(pg.tty);
+	switch (key) {
+	  case 'q': case 'Q': case keyeof:
+	    restoreterminal();
+	    return EXIT_SUCCESS;
+	  case 'j': case 'e': case '\r': case '\n': case keydown:
+	    if (!atend(&pg))
+		pg.top += pg.count;
+	    break;
+	  case 'k': case 'y': case keyup:
+	    movetop(&pg, pg.top - pg.count);
+	    break;
+	  case ' ': case 'f': case keypagedown:
+	    if (!atend(&pg))
+		pg.top += pagelen;
+	    break;
+	  case 'b': case keypageup:
+	    movetop(&pg, pg.top - pagelen);
+	    break;
+	  case 'g': case '<': case keyhome:
+	    pg.top = 0;
+	    break;
+	  case 'G': case '>': case keyend:
+	    if (pg.length < 0)
+		strcpy(pg.message, "The length of the file is not known"
+				   " (see --build-index)");
+	    else if (pg.length > pagelen)
+		movetop(&pg, pg.length - 1 - (pagelen - pg.count));
+	    else
+		pg.top = 0;
+	    break;
+	  case ':':
+	    if (!prompt(&pg, "Offset: ", buf, sizeof buf) || !*buf)
+		break;
+	    errno = 0;
+	    n = strtoll(buf, &end, 0);
+	    if (errno || *end || n < 0)
+		strcpy(pg.message, "Invalid offset");
+	    else
+		movetop(&pg, n);
+	    break;
+	  case '/':
+	    if (!prompt(&pg, "/", buf, sizeof buf))
+		break;
+	    if (*buf) {
+		len = mbstowcs(pg.pattern, buf,
+			       sizeof pg.pattern / sizeof *pg.pattern);
+		if (len == (size_t)-1) {
+		    strcpy(pg.message, "Invalid search string");
+		    break;
+		}
+		pg.patternlen = len;
+	    }
+	    findnext(&pg, pg.top);
+	    break;
+	  case 'n':
+	    findnext(&pg, pg.match >= 0 ? pg.match + 1 : pg.top);
+	    break;
 	}
     }
-    if (optind < argc)
-	s->filenames = argv + optind;
-
-    return forward;
 }
 
 /* Main.
  */
 int main(int argc, char *argv[])
 {
-    state s;
+    chd_options  opts;
+    chd_context *ctx;
+    char       **filenames;
+    int          mode, exitcode;
 
     setlocale(LC_ALL, "");
-    if (parsecommandline(argc, argv, &s))
-	dump(&s);
+    mode = parsecommandline(argc, argv, &opts, &filenames);
+    ctx = chd_new(&opts);
+    free((chd_range*)opts.match);
+    if (!ctx && errno == EINVAL && opts.encoding)
+	die("unsupported encoding '%s'", opts.encoding);
+    if (!ctx)
+	die("chd: %s", strerror(errno));
+    if (mode == modepage && !isatty(STDOUT_FILENO))
+	mode = CHD_DUMP;
+    if (mode == modepage)
+	exitcode = page(ctx, &opts, *filenames);
     else
-	undump(&s);
+	exitcode = chd_files(ctx, mode, filenames) ? EXIT_FAILURE
+						   : EXIT_SUCCESS;
+    if (opts.stats) {
+	fflush(stdout);
+	chd_printstats(ctx, stderr);
+    }
+    chd_free(ctx);
     return exitcode;
 }
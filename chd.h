@@ -0,0 +1,183 @@
+/*
+ * chd.h: The interface to libchd, which produces and reverses
+ * character dumps for the chd program, and for any other program that
+ * wishes to do so in-process.
+ *
+ * Copyright (C) 2013-2017 Brian Raiter <breadbox@muppetlabs.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _chd_h_
+#define _chd_h_
+
+#include <stdio.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The operations that can be performed on a list of files.
+ * CHD_SCAN counts the occurrences of each character instead of
+ * dumping them.
+ */
+enum { CHD_DUMP, CHD_UNDUMP, CHD_INDEX, CHD_EXTRACT, CHD_SCAN };
+
+/* The formats of a dump. CHD_FORMAT_DEFAULT selects a text dump when
+ * dumping, and the characters themselves when undumping. CHD_FORMAT_JSONL
+ * and CHD_FORMAT_CSV output a record for each character, for other
+ * programs to read.
+ */
+enum { CHD_FORMAT_DEFAULT = -1, CHD_FORMAT_TEXT = 1, CHD_FORMAT_BIN = 2,
+       CHD_FORMAT_JSONL = 3, CHD_FORMAT_CSV = 4 };
+
+/* The largest number of characters per line of a text dump. (The
+ * smallest is one.)
+ */
+enum { CHD_MAXCOUNT = 65536 };
+
+/* A range of characters, from first to last inclusive, selected by
+ * --match.
+ */
+typedef struct chd_range {
+    long first;		/* the first character in the range */
+    long last;		/* the last character in the range */
+} chd_range;
+
+/* The settings of a context, corresponding to chd's command-line
+ * options. chd_defaults() fills in the same defaults as the program.
+ */
+typedef struct chd_options {
+    int count;		/* characters per line of a text dump (-c) */
+    int ignore;		/* true to treat invalid sequences as raw bytes (-i) */
+    int format;		/* one of the CHD_FORMAT values (--format) */
+    int autoskip;	/* true to collapse runs of identical lines (-a) */
+    int jobs;		/* threads to use, or zero for one per CPU (-j) */
+    int follow;		/* true to wait for the last file to grow (-f) */
+    int latency;	/* milliseconds to wait for a partial line (--latency) */
+    int usemmap;	/* true to map regular files into memory */
+    int decompress;	/* true to decompress compressed input files */
+    int separate;	/* true to dump each file separately (--separate) */
+    int stats;		/* true to gather statistics (--stats) */
+    long long start;	/* characters of input to skip over (-s) */
+    long long limit;	/* most characters of input to process (-l) */
+    char const *encoding; /* the input encoding, or NULL for the locale's */
+    chd_range const *match; /* the characters to look for (--match) */
+    int matchcount;	/* number of ranges at match, or zero to dump all */
+    int matchraw;	/* true to look for raw bytes as well (--match) */
+    int context;	/* lines to show around each match (-C) */
+} chd_options;
+
+/* A function that receives output: size bytes at buf. It returns zero
+ * on success; any other value causes the remaining output of the call
+ * to be discarded, and the call to fail.
+ */
+typedef int chd_writefn(void *arg, char const *buf, size_t size);
+
+/* A function that supplies input: it stores up to size bytes at buf,
+ * and returns the number stored, zero at the end of the input, or -1
+ * (with errno set) if an error occurs.
+ */
+typedef long chd_readfn(void *arg, char *buf, size_t size);
+
+/* The settings and statistics under which the operations are
+ * performed. A context has no other state, and so can be used for any
+ * number of calls, but only for one call at a time. Different contexts
+ * are independent of each other. Apart from chd_new(), the functions
+ * do not return when memory or threads run out: as in the program, a
+ * message is displayed on stderr and the process exits.
+ */
+typedef struct chd_context chd_context;
+
+/* Fill in the default settings.
+ */
+extern void chd_defaults(chd_options *opts);
+
+/* Create a context with the given settings, using the character
+ * encoding of the current locale (as set by setlocale()) for output,
+ * and also for input unless the settings name another encoding. By
+ * default, output is written to stdout. The return value is NULL, with
+ * errno set, if the settings are invalid (EINVAL, which includes an
+ * unknown encoding) or memory runs out.
+ */
+extern chd_context *chd_new(chd_options const *opts);
+
+/* Free a context.
+ */
+extern void chd_free(chd_context *ctx);
+
+/* Send the context's output to writer, called with arg (or to stdout,
+ * if writer is NULL).
+ */
+extern void chd_setoutput(chd_context *ctx, chd_writefn *writer, void *arg);
+
+/* Dump the size bytes of input at buf, or reverse the dump at buf.
+ * The return value is zero on success, or -1 if errors occurred (which
+ * are described on stderr).
+ */
+extern int chd_dump(chd_context *ctx, void const *buf, size_t size);
+extern int chd_undump(chd_context *ctx, void const *buf, size_t size);
+
+/* Dump, or reverse the dump of, the input supplied by reader, called
+ * with arg. The return value is the same as chd_dump()'s.
+ */
+extern int chd_dumpstream(chd_context *ctx, chd_readfn *reader, void *arg);
+extern int chd_undumpstream(chd_context *ctx, chd_readfn *reader, void *arg);
+
+/* Perform the given operation on the NULL-terminated list of files,
+ * with "-" denoting standard input, exactly as the chd program does.
+ * The return value is the same as chd_dump()'s.
+ */
+extern int chd_files(chd_context *ctx, int operation, char **filenames);
+
+/* Dump count characters of the named file, starting start characters
+ * into it, as lines of the dump of the whole file (ignoring the
+ * context's own --start and --limit). The file's index is used to
+ * reach the start, so that showing any part of a large file takes
+ * about the same time. The return value is the same as chd_dump()'s.
+ */
+extern int chd_dumprange(chd_context *ctx, char const *filename,
+			 long long start, long long count);
+
+/* Search the named file for the len characters at text, from start
+ * characters into it. The return value is the offset of the first
+ * occurrence, or -1 if there is none (or if the search was stopped by
+ * an error, which is described on stderr).
+ */
+extern long long chd_search(chd_context *ctx, char const *filename,
+			    long long start, wchar_t const *text, size_t len);
+
+/* Return the number of characters in the named file, if this can be
+ * found without decoding it (from its index, or directly in a
+ * single-byte encoding), or -1 otherwise.
+ */
+extern long long chd_length(chd_context *ctx, char const *filename);
+
+/* Display the statistics gathered so far by the context.
+ */
+extern void chd_printstats(chd_context *ctx, FILE *fp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,6119 @@
+/*
+ * libchd.c: The library that produces and reverses character dumps.
+ *
+ * Copyright (C) 2013-2017 Brian Raiter <breadbox@muppetlabs.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#define _XOPEN_SOURCE 700
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <wchar.h>
+#include <locale.h>
+#include <langinfo.h>
+#include <iconv.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#endif
+#include <pthread.h>
+#if defined __linux__ && defined __has_include
+#if __has_include(<linux/io_uring.h>)
+#define USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+#ifdef __has_include
+#if __has_include(<zlib.h>)
+#define USE_ZLIB
+#include <zlib.h>
+#endif
+#if __has_include(<lzma.h>)
+#define USE_LZMA
+#include <lzma.h>
+#endif
+#if __has_include(<zstd.h>)
+#define USE_ZSTD
+#include <zstd.h>
+#endif
+#endif
+#if defined USE_ZLIB || defined USE_LZMA || defined USE_ZSTD
+#define USE_DECOMPRESSION
+#endif
+#if defined __x86_64__ && defined __GNUC__
+#include <immintrin.h>
+#elif defined __aarch64__
+#include <arm_neon.h>
+#endif
+#include "chd.h"
+
+static int const ctlpics = 0x2400;	/* Unicode control pics start */
+static int const replacechar = 0xFFFD;	/* Unicode replacement character */
+static int const rawbyte = 0x10000000;	/* flag indicating a raw byte value */
+static int const inbufsize = 65536;	/* size of input blocks in bytes */
+static int const outbufsize = 65536;	/* size of the output buffer */
+static int const chunksize = 262144;	/* bytes per chunk in parallel dumps */
+static int const batchsize = 16;	/* most files per job in --separate */
+static int const readaheadcount = 4;	/* number of read-ahead buffers */
+static int const followinterval = 250;	/* ms between checks for growth */
+static int const indexinterval = 65536;	/* characters between index entries */
+static int const indexheadersize = 88;	/* size of an index file's header */
+static char const *indexsuffix = ".chdx";	/* filename suffix of index files */
+static char const *indexmagic = "CHDINDX1";	/* index file signature */
+static char const *binmagic = "CHDDUMP1";	/* binary dump signature */
+static int const binblocksize = 4096;	/* most characters per binary block */
+static int const recordsize = 96;	/* most bytes in a record of a char */
+static int const nofd = -2;		/* descriptor of input not from a file */
+
+/* The forms in which characters can be output: as themselves, or as
+ * a dump in text or binary format, or as records in JSON Lines or CSV.
+ */
+enum { formatchars, formattext = CHD_FORMAT_TEXT, formatbin = CHD_FORMAT_BIN,
+       formatjsonl = CHD_FORMAT_JSONL, formatcsv = CHD_FORMAT_CSV };
+
+/* The ways in which input can be decoded: by the locale's functions,
+ * by the built-in UTF-8 codec, by a single-byte table, by iconv, or by
+ * the built-in UTF-16 and UTF-32 codecs.
+ */
+enum {
+    codecmbs, codecutf8, codectable, codeciconv,
+    codecutf16le, codecutf16be, codecutf32le, codecutf32be
+};
+
+/* The families of byte order marks that can select a codec.
+ */
+enum { bomutf16 = 1, bomutf32 = 2 };
+
+/* The number of pages of 256 characters in a histogram: those of
+ * Unicode, and one for raw bytes.
+ */
+enum { histpages = 0x1100 + 1 };
+
+/* The statistics gathered for --stats. The times are in nanoseconds.
+ */
+enum {
+    statbytesread, statcharsdecoded, statrawbytes, statlinesrendered,
+    statlinesparsed, statbyteswritten,
+    stattimeinput, stattimedecode, stattimeformat, stattimeoutput,
+    statcount
+};
+
+/* The states of a read-ahead buffer.
+ */
+enum { bufidle, bufpending, bufready };
+
+/* A buffer of input read ahead of the decoder.
+ */
+typedef struct readbuf {
+    char *data;		/* the bytes read */
+    int len;		/* number of bytes read, or zero at the end */
+    int err;		/* the error that stopped reading, if any */
+    int state;		/* bufidle, bufpending or bufready */
+    off_t offset;	/* file offset of the bytes (io_uring only) */
+} readbuf;
+
+/* The state of reading ahead of the decoder, which keeps several
+ * reads of the current file in flight, either through io_uring or on
+ * a separate thread.
+ */
+typedef struct prefetch {
+    readbuf *bufs;	/* the ring of buffers */
+    int head;		/* index of the buffer being consumed */
+    int used;		/* number of bytes consumed from the head buffer */
+    int fill;		/* index of the next buffer to start reading into */
+    int fd;		/* the file being read */
+    int seekable;	/* true if the file is a regular file */
+    int ended;		/* true if the end of the file was reached */
+    off_t nextoffset;	/* file offset of the next read (io_uring only) */
+    int ring;		/* the io_uring descriptor, or -1 */
+    pthread_t thread;	/* the reading thread, if no io_uring */
+    pthread_mutex_t lock; /* lock on the buffers' states (thread only) */
+    pthread_cond_t cond; /* signalled when a buffer changes state */
+    int quit;		/* true if the thread should stop */
+#ifdef USE_IO_URING
+    int pending;	/* number of reads submitted and not completed */
+    void *sqmap, *cqmap; /* the mapped submission and completion rings */
+    size_t sqsize, cqsize; /* sizes of the mapped rings */
+    unsigned *sqtail, *sqmask, *sqarray; /* fields of the submission ring */
+    unsigned *cqhead, *cqtail, *cqmask; /* fields of the completion ring */
+    struct io_uring_sqe *sqes; /* the submission queue entries */
+    struct io_uring_cqe *cqes; /* the completion queue entries */
+    unsigned sqecount;	/* number of submission queue entries */
+#endif
+} prefetch;
+
+/* The compressed formats, and the length of the longest of the
+ * signatures by which they are recognized.
+ */
+enum { compressnone, compressgzip, compressxz, compresszstd };
+enum { maxmagiclen = 6 };
+
+/* The state of decompressing the current file. A thread reads the
+ * compressed file and writes what it decompresses to one end of a
+ * socket pair, and the other end takes the place of the file, which
+ * is then read as if it were a pipe.
+ */
+typedef struct decompressor {
+    int format;		/* the format of the file */
+    int fd;		/* the compressed file */
+    int sock;		/* the thread's end of the socket pair */
+    char head[maxmagiclen]; /* the file's first bytes, if already read */
+    int headlen;	/* number of bytes at head */
+    char *kept;		/* the bytes read so far, while they can be replayed */
+    int keptlen;	/* number of bytes at kept */
+    int keeping;	/* true while all of the bytes read are at kept */
+    int err;		/* the error that stopped the thread, if any */
+    int joined;		/* true if the thread has already been joined */
+    char *in;		/* buffer of compressed bytes */
+    char *out;		/* buffer of decompressed bytes */
+    pthread_t thread;	/* the decompressing thread */
+} decompressor;
+
+/* An area of memory from which buffers are carved in order, for the
+ * line buffers whose sizes depend on the line size. An arena is sized
+ * in advance for its user's needs, and is freed all at once.
+ */
+typedef struct arena {
+    char *base;		/* the memory */
+    size_t size;	/* number of bytes at base */
+    size_t used;	/* number of bytes handed out so far */
+} arena;
+
+/* A range of characters selected by --match, stored as its first
+ * character and the distance to its last, so that ch is in the range
+ * when ch - first, taken as unsigned, is no more than span.
+ */
+typedef struct charrange {
+    unsigned int first;	/* the first character in the range */
+    unsigned int span;	/* the last character minus the first */
+} charrange;
+
+/* The state of reading input for one call, under a context's
+ * settings. The input is either a list of files, an area of memory or
+ * a reader function.
+ */
+typedef struct state {
+    chd_context *ctx;	/* the settings in effect */
+    long long startoffset;	/* skip over this many chars of input at start */
+    long long maxinputlen;	/* stop after this many chars of input */
+    char **filenames;	/* NULL-terminated list of input filenames */
+    char const *memory;	/* the input, if supplied in memory */
+    size_t memorysize;	/* number of bytes at memory */
+    chd_readfn *reader;	/* the function supplying the input, if any */
+    void *readerarg;	/* the reader's argument */
+    int currentfd;	/* descriptor of the open input file, -1 or nofd */
+    int inputerr;	/* pending error for the current input file */
+    off_t readpos;	/* number of bytes read from the current file */
+    off_t blockpos;	/* file offset of the current block's first char */
+    int blockinit;	/* true if the block started in the initial state */
+    mbstate_t mbs;	/* shift state of the current input file */
+    iconv_t iconv;	/* the converter from the input encoding, if used */
+    int codec;		/* the decoder used for the current file */
+    char const *map;	/* contents of the current file, if mapped */
+    off_t mapsize;	/* size of the mapped file */
+    prefetch *ahead;	/* reading ahead of the current file, if any */
+    int noahead;	/* true if reading ahead could not be started */
+    decompressor *unpack; /* decompressing the current file, if any */
+    int injob;		/* true if running as a job, without more threads */
+    int failed;		/* true if an error occurred while running as a job */
+    int binary;		/* true if the current file is a binary dump */
+    int detecting;	/* true if checking the file's first bytes */
+    int following;	/* true if waiting for the current file to grow */
+    int stalled;	/* true if the last read timed out while following */
+    int waitms;		/* how long to wait for more input, or -1 */
+    int watchfd;	/* inotify descriptor watching the current file */
+    char **linefile;	/* entry in filenames of the last line's file */
+    char *bytes;	/* buffer of input bytes awaiting decoding */
+    int bytecount;	/* number of bytes in the bytes buffer */
+    int prefetched;	/* true if bytes were read before the first block */
+    wchar_t *chars;	/* buffer of decoded input characters */
+    int charcount;	/* number of characters in the chars buffer */
+    int charpos;	/* index of the next unread character in chars */
+    arena lines;	/* the line buffers of the current operation */
+} state;
+
+/* An entry in a character index, giving the byte offset of a
+ * character at which the decoder is in its initial shift state.
+ */
+typedef struct indexentry {
+    long long charpos;		/* offset of the character */
+    long long bytepos;		/* offset of the character's first byte */
+} indexentry;
+
+/* The contents of an index file. An index allows --start to seek
+ * most of the way to its destination instead of decoding all of the
+ * preceding characters.
+ */
+typedef struct charindex {
+    long long totalchars;	/* number of characters in the file */
+    int truncated;		/* true if decoding stops at an invalid sequence */
+    int count;			/* number of entries */
+    indexentry *entries;	/* entries, in order of position */
+} charindex;
+
+/* A character as rendered in a line of a text dump: its field in the
+ * hex column, and its glyph in the text column, with any space that
+ * follows it.
+ */
+typedef struct rendercell {
+    wchar_t ch;		/* the character, or -1 if the cell is unused */
+    char hex[6];	/* the field in the hex column */
+    unsigned char len;	/* number of bytes in glyph */
+    char glyph[5];	/* the encoded glyph and any space */
+} rendercell;
+
+/* A buffer of output bytes waiting to be written out, together with a
+ * cache of rendered characters, indexed by the character's low bits.
+ * (The cache is only used when the output encoding has no shift
+ * states, so that a glyph's bytes never vary.)
+ */
+typedef struct output {
+    chd_context *ctx;	/* the context whose output this is */
+    char *buf;		/* the buffered bytes */
+    int len;		/* number of bytes in buf */
+    int size;		/* number of bytes allocated for buf */
+    int grow;		/* if true, enlarge buf instead of flushing it */
+    mbstate_t mbs;	/* shift state of the output */
+    int cache;		/* true if the cache of rendered characters is used */
+    rendercell cells[4096]; /* the cache of rendered characters */
+} output;
+
+/* A pool of threads for running batches of independent jobs.
+ */
+typedef struct workpool {
+    pthread_t *threads;		/* the threads, not including the caller */
+    int count;			/* number of threads */
+    pthread_mutex_t lock;	/* lock protecting the fields below */
+    pthread_cond_t wake;	/* signalled when a batch is started */
+    pthread_cond_t idle;	/* signalled when a batch is completed */
+    void (*job)(void*, int);	/* the function to run for each job */
+    void *data;			/* the function's first argument */
+    int jobcount;		/* number of jobs in the current batch */
+    int nextjob;		/* the next job to be started */
+    int running;		/* number of jobs not yet completed */
+    int quit;			/* true if the threads should exit */
+} workpool;
+
+/* A section of a memory-mapped file that is decoded independently
+ * during a parallel dump.
+ */
+typedef struct dumpchunk {
+    char const *src;	/* the bytes of the chunk */
+    int size;		/* number of bytes in the chunk */
+    wchar_t *chars;	/* the decoded characters */
+    int count;		/* number of characters decoded */
+    int alloced;	/* number of characters allocated for chars */
+    int start;		/* offset of the first character within the round */
+    int err;		/* nonzero if decoding hit an invalid sequence */
+    int outcount;	/* number of characters output (in reverse mode) */
+    int lines;		/* number of lines translated (in reverse mode) */
+    int bad;		/* number of malformed lines (in reverse mode) */
+} dumpchunk;
+
+/* The position within a dump file being translated, used to report
+ * malformed lines.
+ */
+typedef struct dumpsource {
+    char const *filename;	/* the dump file's name, or NULL to not report */
+    long long lineno;		/* number of the current line */
+    int midline;		/* number of pieces read of an overlong line */
+    int bad;			/* number of malformed lines found */
+} dumpsource;
+
+/* A line of a text dump held back by --match, in case a line that
+ * follows it has a match.
+ */
+typedef struct heldline {
+    long long pos;	/* position of the line's first character */
+    int count;		/* number of characters in the line */
+} heldline;
+
+/* The state of showing only the lines of a text dump that contain a
+ * character selected by --match, each with up to context lines before
+ * and after it.
+ */
+typedef struct linefilter {
+    wchar_t *chars;	/* the characters of the held lines */
+    heldline *held;	/* the lines held back, as a ring */
+    int holding;	/* number of lines held */
+    int oldest;		/* index in the ring of the first line held */
+    int after;		/* number of lines still to show after a match */
+    long long next;	/* position following the last line shown, or -1 */
+} linefilter;
+
+/* The state of collapsing runs of identical lines in a text dump.
+ */
+typedef struct linerun {
+    wchar_t *prev;	/* the previous full line */
+    int full;		/* true if prev holds a full line */
+    int skipping;	/* true if lines identical to prev are being skipped */
+    long long pos;	/* position of the last line skipped */
+} linerun;
+
+/* The destination of the characters recovered from a dump file.
+ * Besides being output as themselves, they can be dumped again in
+ * any of the dump formats, which requires keeping track of their
+ * positions.
+ */
+typedef struct dumptarget {
+    output *out;	/* the output buffer */
+    int format;		/* formatchars or one of the dump formats */
+    wchar_t *line;	/* characters awaiting a full line or block */
+    int count;		/* number of characters in line */
+    long long pos;	/* position of the next character, or -1 if none yet */
+    linerun run;	/* the state of collapsing lines (--autoskip) */
+    wchar_t *last;	/* characters of the last line translated */
+    int lastcount;	/* number of characters in last */
+    long long lastpos;	/* position of the first character in last */
+    int repeating;	/* true if last is repeated up to the next line */
+} dumptarget;
+
+/* The stages of parsing a binary dump.
+ */
+enum { binsignature, binstart, bincount, binbitmap, binvalues, binbroken };
+
+/* The state of parsing a binary dump file, which can be supplied in
+ * pieces of any size.
+ */
+typedef struct binparser {
+    chd_context *ctx;		/* the context to report errors in */
+    char const *filename;	/* the dump file's name */
+    int stage;			/* the part of the dump expected next */
+    int got;			/* bytes of the signature or bitmap parsed */
+    unsigned long long value;	/* value of the varint being parsed */
+    int shift;			/* number of bits of the varint parsed */
+    int count;			/* number of values in the current block */
+    int index;			/* number of values parsed in the block */
+    int hasraw;			/* true if the block includes raw bytes */
+    long long pos;		/* position of the next character */
+    unsigned char bitmap[512];	/* flags marking the block's raw bytes */
+} binparser;
+
+/* The number of times that a character occurs in the input, and the
+ * position of its first occurrence.
+ */
+typedef struct charcount {
+    long long count;	/* number of occurrences */
+    long long first;	/* offset of the first occurrence */
+} charcount;
+
+/* The characters counted by --scan, in pages of 256 characters that
+ * are allocated when one of their characters first appears. The raw
+ * bytes have a page of their own, after the last page of Unicode.
+ */
+typedef struct histogram {
+    charcount *pages[histpages];	/* the pages, or NULL if unused */
+    long long other;		/* number of characters beyond Unicode */
+} histogram;
+
+/* The state of a parallel dump, or of a parallel reverse dump.
+ */
+typedef struct paralleldump {
+    chd_context *ctx;	/* the settings in effect */
+    int codec;		/* the decoder used for the file */
+    dumpchunk *chunks;	/* left-over characters followed by the chunks */
+    output *outs;	/* output buffers, one per job */
+    dumptarget *targets; /* targets using the output buffers (reverse mode) */
+    long long pos;	/* position of the first character in the round */
+    int total;		/* number of characters to dump in the round */
+    int unit;		/* characters per line, or per block of a binary dump */
+    int linecount;	/* number of lines to dump in the round */
+    int linesperjob;	/* number of lines rendered by each job */
+    int linelen;	/* size of the line buffers (in reverse mode) */
+    wchar_t *lines;	/* the line buffers of the jobs */
+    arena buffers;	/* the memory of the line buffers and targets */
+    histogram *counts;	/* the characters counted by each job (--scan) */
+} paralleldump;
+
+/* A batch of small files being dumped separately by the worker
+ * threads.
+ */
+typedef struct separatebatch {
+    state const *settings;	/* the state to dump each file with */
+    char **filenames;		/* the files in the batch */
+    output *outs;		/* the dump of each file */
+    int *failed;		/* true for each file that had errors */
+} separatebatch;
+
+/* A context: the settings under which input is dumped, together with
+ * the statistics and the outcome of the current call, in place of
+ * global variables, so that any number of contexts can be in use at
+ * once. The worker threads of a call share its context.
+ */
+struct chd_context {
+    int linesize;	/* number of characters per line of a text dump */
+    int acceptbadchars;	/* if nonzero, read invalid sequences as raw bytes */
+    int format;		/* the format requested, or CHD_FORMAT_DEFAULT */
+    int outputformat;	/* the form of the output in the current call */
+    int detectbinary;	/* if nonzero, check input files for binary dumps */
+    int autoskip;	/* if nonzero, collapse runs of identical lines */
+    int separatefiles;	/* if nonzero, dump each input file separately */
+    int usemmap;	/* if nonzero, memory-map regular input files */
+    int decompress;	/* if nonzero, decompress compressed input files */
+    int jobs;		/* the number of threads to use for dumping */
+    int followinput;	/* if nonzero, wait at the end of the last file */
+    int latency;	/* ms to wait for more input before a partial line */
+    int showstats;	/* if nonzero, statistics are gathered */
+    long long stats[statcount]; /* the statistics gathered for --stats */
+    long long startoffset; /* characters to skip at the start of input */
+    long long maxinputlen; /* most characters of input to process */
+    int singlebyte;	/* if nonzero, every byte is decoded as one character */
+    int utf8locale;	/* if nonzero, output uses the built-in UTF-8 codec */
+    int codec;		/* the decoder used for input */
+    int detectbom;	/* the byte order marks that override the codec */
+    unsigned short const *table; /* the decoding table, for codectable */
+    char *encoding;	/* the input encoding's name, or NULL if the locale's */
+    charrange *match;	/* the characters selected by --match, if any */
+    int matchcount;	/* number of ranges in match, or zero to show all */
+    int context;	/* lines to show around each line with a match */
+    chd_writefn *writer; /* the function receiving output, or NULL */
+    void *writerarg;	/* the writer's argument */
+    int writefailed;	/* true if the writer failed in the current call */
+    int exitcode;	/* the (eventual) exit code of the current call */
+};
+
+/*
+ * Basic functions.
+ */
+
+/* Display a formatted message on stderr and exit. (This is done only
+ * when memory or threads run out.)
+ */
+static void die(char const *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+    exit(EXIT_FAILURE);
+}
+
+/* Display an error message for the current file and set the exit code.
+ * A job only notes the failure, since the context is shared with the
+ * other jobs; the file is then dumped again by itself, so that the
+ * message appears in order.
+ */
+static void fail(state *s)
+{
+    if (s->injob) {
+	s->failed = 1;
+	return;
+    }
+    perror(s->filenames && *s->filenames ? *s->filenames : "chd");
+    s->ctx->exitcode = EXIT_FAILURE;
+}
+
+/* Return the number of bytes that an arena sets aside for a buffer
+ * of the given size, which keeps each buffer suitably aligned.
+ */
+static size_t arenaspan(size_t size)
+{
+    return (size + 15) & ~(size_t)15;
+}
+
+/* Allocate an arena of the given size.
+ */
+static void arenainit(arena *a, size_t size)
+{
+    a->base = malloc(size ? size : 1);
+    if (!a->base)
+	die("out of memory");
+    a->size = size;
+    a->used = 0;
+}
+
+/* Hand out the next size bytes of an arena. Running out means that
+ * the arena was sized wrongly, which is a bug.
+ */
+static void *arenaalloc(arena *a, size_t size)
+{
+    void *p;
+
+    size = arenaspan(size);
+    if (size > a->size - a->used)
+	die("internal error: line buffer arena exhausted");
+    p = a->base + a->used;
+    a->used += size;
+    return p;
+}
+
+/* Free an arena.
+ */
+static void arenafree(arena *a)
+{
+    free(a->base);
+    a->base = NULL;
+}
+
+/* Return the current time in nanoseconds from the monotonic clock.
+ */
+static long long monotime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Statistics.
+ */
+
+/* Add n to one of the statistics, if they are being gathered. (The
+ * statistics are shared with the worker threads.)
+ */
+static void addstat(chd_context *ctx, int which, long long n)
+{
+    if (ctx->showstats)
+	__atomic_fetch_add(&ctx->stats[which], n, __ATOMIC_RELAXED);
+}
+
+/* Return the current time in nanoseconds from the monotonic clock,
+ * or zero if statistics are not being gathered. The intervals
+ * measured are passed to addstat().
+ */
+static long long stattime(chd_context *ctx)
+{
+    return ctx->showstats ? monotime() : 0;
+}
+
+/*
+ * The built-in UTF-8 codec.
+ */
+
+/* Decode the UTF-8 sequence of at most len bytes at p, storing the
+ * character in pch. The return value is the length of the sequence,
+ * zero if the sequence is incomplete, or -1 if it is invalid. The
+ * sequences accepted are the same as glibc's: up to six bytes long,
+ * with overlong forms and surrogates rejected.
+ */
+static int utf8decode(unsigned char const *p, int len, wchar_t *pch)
+{
+    unsigned int ch, min;
+    int n, i;
+
+    if (*p < 0x80) {
+	*pch = *p;
+	return 1;
+    } else if (*p < 0xC2) {
+	return -1;
+    } else if (*p < 0xE0) {
+	n = 2;
+	ch = *p & 0x1F;
+	min = 0x80;
+    } else if (*p < 0xF0) {
+	n = 3;
+	ch = *p & 0x0F;
+	min = 0x800;
+    } else if (*p < 0xF8) {
+	n = 4;
+	ch = *p & 0x07;
+	min = 0x10000;
+    } else if (*p < 0xFC) {
+	n = 5;
+	ch = *p & 0x03;
+	min = 0x200000;
+    } else if (*p < 0xFE) {
+	n = 6;
+	ch = *p & 0x01;
+	min = 0x4000000;
+    } else {
+	return -1;
+    }
+    for (i = 1 ; i < n ; ++i) {
+	if (i >= len)
+	    return 0;
+	if ((p[i] & 0xC0) != 0x80)
+	    return -1;
+	ch = (ch << 6) | (p[i] & 0x3F);
+    }
+    if (ch < min || (ch >= 0xD800 && ch < 0xE000))
+	return -1;
+    *pch = ch;
+    return n;
+}
+
+/* Store the UTF-8 encoding of ch at p. The return value is the
+ * length of the encoding, or -1 if ch has no valid encoding.
+ */
+static int utf8encode(char *p, unsigned int ch)
+{
+    int n, i;
+
+    if (ch < 0x80) {
+	*p = ch;
+	return 1;
+    } else if (ch < 0x800) {
+	n = 2;
+    } else if (ch < 0x10000) {
+	if (ch >= 0xD800 && ch < 0xE000)
+	    return -1;
+	n = 3;
+    } else if (ch < 0x200000) {
+	n = 4;
+    } else if (ch < 0x4000000) {
+	n = 5;
+    } else if (ch < 0x80000000) {
+	n = 6;
+    } else {
+	return -1;
+    }
+    for (i = n - 1 ; i > 0 ; --i) {
+	p[i] = 0x80 | (ch & 0x3F);
+	ch >>= 6;
+    }
+    p[0] = (0xFF00 >> n) | ch;
+    return n;
+}
+
+/* Copy the bytes at p into out as characters, for as long as they
+ * are ASCII, stopping after at most len bytes. The return value is the
+ * number of bytes copied, which may stop short of the first non-ASCII
+ * byte by up to one block. The portable version works on eight bytes
+ * at a time; the vectorized versions below on 16, 32 or 64.
+ */
+static int asciirunscalar(unsigned char const *p, int len, wchar_t *out)
+{
+    unsigned long long word;
+    int n, i;
+
+    for (n = 0 ; n + 8 <= len ; n += 8) {
+	memcpy(&word, p + n, 8);
+	if (word & 0x8080808080808080ULL)
+	    break;
+	for (i = 0 ; i < 8 ; ++i)
+	    out[n + i] = p[n + i];
+    }
+    return n;
+}
+
+#if defined __x86_64__ && defined __GNUC__ && __SIZEOF_WCHAR_T__ == 4
+
+/* The SSE2 versions are also used to finish the work of the AVX
+ * versions, into which they are inlined so as to be encoded as AVX
+ * instructions. Calling them instead would run their SSE instructions
+ * with the upper halves of the vector registers still in use, which
+ * the compiler does not always prevent, and which makes them several
+ * times slower.
+ */
+static inline int asciirunsse2(unsigned char const *p, int len, wchar_t *out)
+{
+    __m128i zero, v, lo, hi;
+    int n;
+
+    zero = _mm_setzero_si128();
+    for (n = 0 ; n + 16 <= len ; n += 16) {
+	v = _mm_loadu_si128((__m128i const*)(p + n));
+	if (_mm_movemask_epi8(v))
+	    break;
+	lo = _mm_unpacklo_epi8(v, zero);
+	hi = _mm_unpackhi_epi8(v, zero);
+	_mm_storeu_si128((__m128i*)(out + n), _mm_unpacklo_epi16(lo, zero));
+	_mm_storeu_si128((__m128i*)(out + n + 4), _mm_unpackhi_epi16(lo, zero));
+	_mm_storeu_si128((__m128i*)(out + n + 8), _mm_unpacklo_epi16(hi, zero));
+	_mm_storeu_si128((__m128i*)(out + n + 12), _mm_unpackhi_epi16(hi, zero));
+    }
+    return n;
+}
+
+__attribute__((target("avx2")))
+static int asciirunavx2(unsigned char const *p, int len, wchar_t *out)
+{
+    __m256i v;
+    int n, i;
+
+    for (n = 0 ; n + 32 <= len ; n += 32) {
+	v = _mm256_loadu_si256((__m256i const*)(p + n));
+	if (_mm256_movemask_epi8(v))
+	    break;
+	for (i = 0 ; i < 32 ; i += 8)
+	    _mm256_storeu_si256((__m256i*)(out + n + i),
+		    _mm256_cvtepu8_epi32(
+			    _mm_loadl_epi64((__m128i const*)(p + n + i))));
+    }
+    return n + asciirunsse2(p + n, len - n, out + n);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int asciirunavx512(unsigned char const *p, int len, wchar_t *out)
+{
+    __m512i v;
+    int n, i;
+
+    for (n = 0 ; n + 64 <= len ; n += 64) {
+	v = _mm512_loadu_si512((void const*)(p + n));
+	if (_mm512_movepi8_mask(v))
+	    break;
+	for (i = 0 ; i < 64 ; i += 16)
+	    _mm512_storeu_si512((void*)(out + n + i),
+		    _mm512_cvtepu8_epi32(
+			    _mm_loadu_si128((__m128i const*)(p + n + i))));
+    }
+    return n + asciirunavx2(p + n, len - n, out + n);
+}
+
+#elif defined __aarch64__ && __SIZEOF_WCHAR_T__ == 4
+
+static int asciirunneon(unsigned char const *p, int len, wchar_t *out)
+{
+    uint8x16_t  v;
+    uint16x8_t  lo, hi;
+    int         n;
+
+    for (n = 0 ; n + 16 <= len ; n += 16) {
+	v = vld1q_u8(p + n);
+	if (vmaxvq_u8(v) & 0x80)
+	    break;
+	lo = vmovl_u8(vget_low_u8(v));
+	hi = vmovl_high_u8(v);
+	vst1q_u32((uint32_t*)(out + n), vmovl_u16(vget_low_u16(lo)));
+	vst1q_u32((uint32_t*)(out + n + 4), vmovl_high_u16(lo));
+	vst1q_u32((uint32_t*)(out + n + 8), vmovl_u16(vget_low_u16(hi)));
+	vst1q_u32((uint32_t*)(out + n + 12), vmovl_high_u16(hi));
+    }
+    return n;
+}
+
+#endif
+
+/* Copy the UTF-16 code units at p (big-endian if big is true) into
+ * out as characters, for as long as they are not surrogates, stopping
+ * after at most count units. The return value is the number of units
+ * copied, which may stop short of the first surrogate by up to one
+ * block. The portable version goes one unit at a time; the vectorized
+ * versions below work on 8, 16 or 32.
+ */
+static int bmprunscalar(unsigned char const *p, int count, int big,
+			wchar_t *out)
+{
+    unsigned int u;
+    int n;
+
+    for (n = 0 ; n < count ; ++n, p += 2) {
+	u = big ? p[0] << 8 | p[1] : p[1] << 8 | p[0];
+	if ((u & 0xF800) == 0xD800)
+	    break;
+	out[n] = u;
+    }
+    return n;
+}
+
+#if defined __x86_64__ && defined __GNUC__ && __SIZEOF_WCHAR_T__ == 4
+
+static inline int bmprunsse2(unsigned char const *p, int count, int big,
+			     wchar_t *out)
+{
+    __m128i zero, mask, surrogate, v;
+    int n;
+
+    zero = _mm_setzero_si128();
+    mask = _mm_set1_epi16((short)0xF800);
+    surrogate = _mm_set1_epi16((short)0xD800);
+    for (n = 0 ; n + 8 <= count ; n += 8) {
+	v = _mm_loadu_si128((__m128i const*)(p + 2 * n));
+	if (big)
+	    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+	if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, mask),
+					      surrogate)))
+	    break;
+	_mm_storeu_si128((__m128i*)(out + n), _mm_unpacklo_epi16(v, zero));
+	_mm_storeu_si128((__m128i*)(out + n + 4), _mm_unpackhi_epi16(v, zero));
+    }
+    return n;
+}
+
+__attribute__((target("avx2")))
+static int bmprunavx2(unsigned char const *p, int count, int big,
+		      wchar_t *out)
+{
+    __m256i mask, surrogate, swap, v;
+    int n;
+
+    mask = _mm256_set1_epi16((short)0xF800);
+    surrogate = _mm256_set1_epi16((short)0xD800);
+    swap = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12,
+			    15, 14, 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10,
+			    13, 12, 15, 14);
+    for (n = 0 ; n + 16 <= count ; n += 16) {
+	v = _mm256_loadu_si256((__m256i const*)(p + 2 * n));
+	if (big)
+	    v = _mm256_shuffle_epi8(v, swap);
+	if (_mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_and_si256(v, mask),
+						    surrogate)))
+	    break;
+	_mm256_storeu_si256((__m256i*)(out + n),
+			    _mm256_cvtepu16_epi32(_mm256_castsi256_si128(v)));
+	_mm256_storeu_si256((__m256i*)(out + n + 8),
+			    _mm256_cvtepu16_epi32(
+				    _mm256_extracti128_si256(v, 1)));
+    }
+    return n + bmprunsse2(p + 2 * n, count - n, big, out + n);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int bmprunavx512(unsigned char const *p, int count, int big,
+			wchar_t *out)
+{
+    __m512i mask, surrogate, v;
+    int n;
+
+    mask = _mm512_set1_epi16((short)0xF800);
+    surrogate = _mm512_set1_epi16((short)0xD800);
+    for (n = 0 ; n + 32 <= count ; n += 32) {
+	v = _mm512_loadu_si512((void const*)(p + 2 * n));
+	if (big)
+	    v = _mm512_or_si512(_mm512_slli_epi16(v, 8),
+				_mm512_srli_epi16(v, 8));
+	if (_mm512_cmpeq_epi16_mask(_mm512_and_si512(v, mask), surrogate))
+	    break;
+	_mm512_storeu_si512((void*)(out + n),
+			    _mm512_cvtepu16_epi32(_mm512_castsi512_si256(v)));
+	_mm512_storeu_si512((void*)(out + n + 16),
+			    _mm512_cvtepu16_epi32(
+				    _mm512_extracti64x4_epi64(v, 1)));
+    }
+    return n + bmprunavx2(p + 2 * n, count - n, big, out + n);
+}
+
+#elif defined __aarch64__ && __SIZEOF_WCHAR_T__ == 4
+
+static int bmprunneon(unsigned char const *p, int count, int big,
+		      wchar_t *out)
+{
+    uint16x8_t  v;
+    int         n;
+
+    for (n = 0 ; n + 8 <= count ; n += 8) {
+	v = vreinterpretq_u16_u8(vld1q_u8(p + 2 * n));
+	if (big)
+	    v = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(v)));
+	if (vmaxvq_u16(vceqq_u16(vandq_u16(v, vdupq_n_u16(0xF800)),
+				 vdupq_n_u16(0xD800))))
+	    break;
+	vst1q_u32((uint32_t*)(out + n), vmovl_u16(vget_low_u16(v)));
+	vst1q_u32((uint32_t*)(out + n + 4), vmovl_high_u16(v));
+    }
+    return n;
+}
+
+#endif
+
+/* Return true if any of the n characters at buf is in one of the
+ * count ranges. The portable version tests one character at a time;
+ * the vectorized versions below test 4, 8 or 16 against each range.
+ */
+static int matchrunscalar(wchar_t const *buf, int n, charrange const *ranges,
+			  int count)
+{
+    int i, r;
+
+    for (i = 0 ; i < n ; ++i)
+	for (r = 0 ; r < count ; ++r)
+	    if ((unsigned int)buf[i] - ranges[r].first <= ranges[r].span)
+		return 1;
+    return 0;
+}
+
+#if defined __x86_64__ && defined __GNUC__ && __SIZEOF_WCHAR_T__ == 4
+
+/* SSE2 has no unsigned comparison, so both sides are biased to make
+ * a signed one do.
+ */
+static inline int matchrunsse2(wchar_t const *buf, int n,
+			       charrange const *ranges, int count)
+{
+    __m128i bias, v, hits;
+    int i, r;
+
+    bias = _mm_set1_epi32((int)0x80000000);
+    for (i = 0 ; i + 4 <= n ; i += 4) {
+	v = _mm_loadu_si128((__m128i const*)(buf + i));
+	hits = _mm_setzero_si128();
+	for (r = 0 ; r < count ; ++r)
+	    hits = _mm_or_si128(hits, _mm_cmpgt_epi32(
+		    _mm_set1_epi32((int)(ranges[r].span ^ 0x80000000) + 1),
+		    _mm_xor_si128(_mm_sub_epi32(v,
+				    _mm_set1_epi32((int)ranges[r].first)),
+				  bias)));
+	if (_mm_movemask_epi8(hits))
+	    return 1;
+    }
+    return matchrunscalar(buf + i, n - i, ranges, count);
+}
+
+__attribute__((target("avx2")))
+static int matchrunavx2(wchar_t const *buf, int n, charrange const *ranges,
+			int count)
+{
+    __m256i v, d, span, hits;
+    int i, r;
+
+    for (i = 0 ; i + 8 <= n ; i += 8) {
+	v = _mm256_loadu_si256((__m256i const*)(buf + i));
+	hits = _mm256_setzero_si256();
+	for (r = 0 ; r < count ; ++r) {
+	    span = _mm256_set1_epi32((int)ranges[r].span);
+	    d = _mm256_sub_epi32(v, _mm256_set1_epi32((int)ranges[r].first));
+	    hits = _mm256_or_si256(hits, _mm256_cmpeq_epi32(
+					_mm256_max_epu32(d, span), span));
+	}
+	if (_mm256_movemask_epi8(hits))
+	    return 1;
+    }
+    return matchrunsse2(buf + i, n - i, ranges, count);
+}
+
+/* AVX-512 has unsigned comparisons that produce a mask directly.
+ */
+__attribute__((target("avx512f")))
+static int matchrunavx512(wchar_t const *buf, int n, charrange const *ranges,
+			  int count)
+{
+    __m512i   v;
+    __mmask16 hits;
+    int       i, r;
+
+    for (i = 0 ; i + 16 <= n ; i += 16) {
+	v = _mm512_loadu_si512((void const*)(buf + i));
+	hits = 0;
+	for (r = 0 ; r < count ; ++r)
+	    hits |= _mm512_cmple_epu32_mask(
+			_mm512_sub_epi32(v, _mm512_set1_epi32((int)ranges[r].first)),
+			_mm512_set1_epi32((int)ranges[r].span));
+	if (hits)
+	    return 1;
+    }
+    return matchrunavx2(buf + i, n - i, ranges, count);
+}
+
+#elif defined __aarch64__ && __SIZEOF_WCHAR_T__ == 4
+
+static int matchrunneon(wchar_t const *buf, int n, charrange const *ranges,
+			int count)
+{
+    uint32x4_t  v, hits;
+    int         i, r;
+
+    for (i = 0 ; i + 4 <= n ; i += 4) {
+	v = vld1q_u32((uint32_t const*)(buf + i));
+	hits = vdupq_n_u32(0);
+	for (r = 0 ; r < count ; ++r)
+	    hits = vorrq_u32(hits,
+			     vcleq_u32(vsubq_u32(v, vdupq_n_u32(ranges[r].first)),
+				       vdupq_n_u32(ranges[r].span)));
+	if (vmaxvq_u32(hits))
+	    return 1;
+    }
+    return matchrunscalar(buf + i, n - i, ranges, count);
+}
+
+#endif
+
+/* The ASCII run, BMP run and match functions best suited to the
+ * current CPU.
+ */
+static int (*asciirun)(unsigned char const*, int, wchar_t*) = asciirunscalar;
+static int (*bmprun)(unsigned char const*, int, int, wchar_t*) = bmprunscalar;
+static int (*matchrun)(wchar_t const*, int, charrange const*, int)
+	= matchrunscalar;
+
+/* Select the vectorized functions that the CPU supports.
+ */
+static void selectkernels(void)
+{
+#if defined __x86_64__ && defined __GNUC__ && __SIZEOF_WCHAR_T__ == 4
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")
+		&& __builtin_cpu_supports("avx512bw")) {
+	asciirun = asciirunavx512;
+	bmprun = bmprunavx512;
+	matchrun = matchrunavx512;
+    } else if (__builtin_cpu_supports("avx2")) {
+	asciirun = asciirunavx2;
+	bmprun = bmprunavx2;
+	matchrun = matchrunavx2;
+    } else {
+	asciirun = asciirunsse2;
+	bmprun = bmprunsse2;
+	matchrun = matchrunsse2;
+    }
+#elif defined __aarch64__ && __SIZEOF_WCHAR_T__ == 4
+    asciirun = asciirunneon;
+    bmprun = bmprunneon;
+    matchrun = matchrunneon;
+#endif
+}
+
+/*
+ * Input encodings.
+ */
+
+/* The decoding tables of the built-in single-byte encodings, giving
+ * the character for each of the bytes 0x80 to 0xFF (the lower half
+ * being ASCII). A zero entry marks a byte that the encoding leaves
+ * undefined.
+ */
+static unsigned short const latin1table[128] = {
+    0x0080, 0x0081, 0x0082, 0x0083, 0x0084, 0x0085, 0x0086, 0x0087,
+    0x0088, 0x0089, 0x008A, 0x008B, 0x008C, 0x008D, 0x008E, 0x008F,
+    0x0090, 0x0091, 0x0092, 0x0093, 0x0094, 0x0095, 0x0096, 0x0097,
+    0x0098, 0x0099, 0x009A, 0x009B, 0x009C, 0x009D, 0x009E, 0x009F,
+    0x00A0, 0x00A1, 0x00A2, 0x00A3, 0x00A4, 0x00A5, 0x00A6, 0x00A7,
+    0x00A8, 0x00A9, 0x00AA, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x00AF,
+    0x00B0, 0x00B1, 0x00B2, 0x00B3, 0x00B4, 0x00B5, 0x00B6, 0x00B7,
+    0x00B8, 0x00B9, 0x00BA, 0x00BB, 0x00BC, 0x00BD, 0x00BE, 0x00BF,
+    0x00C0, 0x00C1, 0x00C2, 0x00C3, 0x00C4, 0x00C5, 0x00C6, 0x00C7,
+    0x00C8, 0x00C9, 0x00CA, 0x00CB, 0x00CC, 0x00CD, 0x00CE, 0x00CF,
+    0x00D0, 0x00D1, 0x00D2, 0x00D3, 0x00D4, 0x00D5, 0x00D6, 0x00D7,
+    0x00D8, 0x00D9, 0x00DA, 0x00DB, 0x00DC, 0x00DD, 0x00DE, 0x00DF,
+    0x00E0, 0x00E1, 0x00E2, 0x00E3, 0x00E4, 0x00E5, 0x00E6, 0x00E7,
+    0x00E8, 0x00E9, 0x00EA, 0x00EB, 0x00EC, 0x00ED, 0x00EE, 0x00EF,
+    0x00F0, 0x00F1, 0x00F2, 0x00F3, 0x00F4, 0x00F5, 0x00F6, 0x00F7,
+    0x00F8, 0x00F9, 0x00FA, 0x00FB, 0x00FC, 0x00FD, 0x00FE, 0x00FF,
+};
+static unsigned short const cp1252table[128] = {
+    0x20AC, 0x0000, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+    0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x0000, 0x017D, 0x0000,
+    0x0000, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+    0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x0000, 0x017E, 0x0178,
+    0x00A0, 0x00A1, 0x00A2, 0x00A3, 0x00A4, 0x00A5, 0x00A6, 0x00A7,
+    0x00A8, 0x00A9, 0x00AA, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x00AF,
+    0x00B0, 0x00B1, 0x00B2, 0x00B3, 0x00B4, 0x00B5, 0x00B6, 0x00B7,
+    0x00B8, 0x00B9, 0x00BA, 0x00BB, 0x00BC, 0x00BD, 0x00BE, 0x00BF,
+    0x00C0, 0x00C1, 0x00C2, 0x00C3, 0x00C4, 0x00C5, 0x00C6, 0x00C7,
+    0x00C8, 0x00C9, 0x00CA, 0x00CB, 0x00CC, 0x00CD, 0x00CE, 0x00CF,
+    0x00D0, 0x00D1, 0x00D2, 0x00D3, 0x00D4, 0x00D5, 0x00D6, 0x00D7,
+    0x00D8, 0x00D9, 0x00DA, 0x00DB, 0x00DC, 0x00DD, 0x00DE, 0x00DF,
+    0x00E0, 0x00E1, 0x00E2, 0x00E3, 0x00E4, 0x00E5, 0x00E6, 0x00E7,
+    0x00E8, 0x00E9, 0x00EA, 0x00EB, 0x00EC, 0x00ED, 0x00EE, 0x00EF,
+    0x00F0, 0x00F1, 0x00F2, 0x00F3, 0x00F4, 0x00F5, 0x00F6, 0x00F7,
+    0x00F8, 0x00F9, 0x00FA, 0x00FB, 0x00FC, 0x00FD, 0x00FE, 0x00FF,
+};
+static unsigned short const koi8rtable[128] = {
+    0x2500, 0x2502, 0x250C, 0x2510, 0x2514, 0x2518, 0x251C, 0x2524,
+    0x252C, 0x2534, 0x253C, 0x2580, 0x2584, 0x2588, 0x258C, 0x2590,
+    0x2591, 0x2592, 0x2593, 0x2320, 0x25A0, 0x2219, 0x221A, 0x2248,
+    0x2264, 0x2265, 0x00A0, 0x2321, 0x00B0, 0x00B2, 0x00B7, 0x00F7,
+    0x2550, 0x2551, 0x2552, 0x0451, 0x2553, 0x2554, 0x2555, 0x2556,
+    0x2557, 0x2558, 0x2559, 0x255A, 0x255B, 0x255C, 0x255D, 0x255E,
+    0x255F, 0x2560, 0x2561, 0x0401, 0x2562, 0x2563, 0x2564, 0x2565,
+    0x2566, 0x2567, 0x2568, 0x2569, 0x256A, 0x256B, 0x256C, 0x00A9,
+    0x044E, 0x0430, 0x0431, 0x0446, 0x0434, 0x0435, 0x0444, 0x0433,
+    0x0445, 0x0438, 0x0439, 0x043A, 0x043B, 0x043C, 0x043D, 0x043E,
+    0x043F, 0x044F, 0x0440, 0x0441, 0x0442, 0x0443, 0x0436, 0x0432,
+    0x044C, 0x044B, 0x0437, 0x0448, 0x044D, 0x0449, 0x0447, 0x044A,
+    0x042E, 0x0410, 0x0411, 0x0426, 0x0414, 0x0415, 0x0424, 0x0413,
+    0x0425, 0x0418, 0x0419, 0x041A, 0x041B, 0x041C, 0x041D, 0x041E,
+    0x041F, 0x042F, 0x0420, 0x0421, 0x0422, 0x0423, 0x0416, 0x0412,
+    0x042C, 0x042B, 0x0417, 0x0428, 0x042D, 0x0429, 0x0427, 0x042A,
+};
+
+/* The encodings that can be selected by name without iconv. The names
+ * are compared ignoring case and punctuation. UTF-16 and UTF-32 without
+ * a byte order are big-endian, unless a byte order mark says otherwise.
+ */
+static struct {
+    char const *name;			/* the name, as normalized */
+    char const *canonical;		/* the name as it is recorded */
+    int codec;				/* the decoder used */
+    unsigned short const *table;	/* the decoding table, if any */
+    int detectbom;			/* byte order marks recognized */
+} const builtinencodings[] = {
+    { "utf8", "UTF-8", codecutf8, NULL, 0 },
+    { "latin1", "ISO-8859-1", codectable, latin1table, 0 },
+    { "l1", "ISO-8859-1", codectable, latin1table, 0 },
+    { "iso88591", "ISO-8859-1", codectable, latin1table, 0 },
+    { "cp1252", "CP1252", codectable, cp1252table, 0 },
+    { "windows1252", "CP1252", codectable, cp1252table, 0 },
+    { "koi8r", "KOI8-R", codectable, koi8rtable, 0 },
+    { "utf16", "UTF-16", codecutf16be, NULL, bomutf16 },
+    { "utf16le", "UTF-16LE", codecutf16le, NULL, 0 },
+    { "utf16be", "UTF-16BE", codecutf16be, NULL, 0 },
+    { "utf32", "UTF-32", codecutf32be, NULL, bomutf32 },
+    { "utf32le", "UTF-32LE", codecutf32le, NULL, 0 },
+    { "utf32be", "UTF-32BE", codecutf32be, NULL, 0 }
+};
+
+/* The byte order marks, and the codecs they select. The marks of
+ * UTF-32 come first, since that of UTF-32LE begins with that of
+ * UTF-16LE.
+ */
+static struct {
+    char const *bytes;	/* the encoding of U+FEFF */
+    int len;		/* the length of the mark */
+    int codec;		/* the decoder selected by the mark */
+    int family;		/* the family of the mark */
+} const byteordermarks[] = {
+    { "\0\0\xFE\xFF", 4, codecutf32be, bomutf32 },
+    { "\xFF\xFE\0\0", 4, codecutf32le, bomutf32 },
+    { "\xFE\xFF", 2, codecutf16be, bomutf16 },
+    { "\xFF\xFE", 2, codecutf16le, bomutf16 }
+};
+
+/* Select the decoder that the context uses for the named encoding:
+ * a built-in codec, a decoding table, or failing those, iconv
+ * (converting to wide characters). The name recorded for the encoding
+ * is stored in freshly allocated memory. The return value is false if
+ * the encoding is unknown, or memory runs out.
+ */
+static int selectencoding(chd_context *ctx, char const *name)
+{
+    char        normal[32];
+    iconv_t     cd;
+    size_t      i, n, count;
+
+    n = 0;
+    for (i = 0 ; name[i] && n < sizeof normal - 1 ; ++i)
+	if (isalnum((unsigned char)name[i]))
+	    normal[n++] = tolower((unsigned char)name[i]);
+    normal[n] = '\0';
+    count = sizeof builtinencodings / sizeof *builtinencodings;
+    for (i = 0 ; i < count ; ++i) {
+	if (!strcmp(normal, builtinencodings[i].name)) {
+	    ctx->codec = builtinencodings[i].codec;
+	    ctx->table = builtinencodings[i].table;
+	    ctx->detectbom = builtinencodings[i].detectbom;
+	    ctx->encoding = strdup(builtinencodings[i].canonical);
+	    return ctx->encoding != NULL;
+	}
+    }
+    cd = iconv_open("WCHAR_T", name);
+    if (cd == (iconv_t)-1) {
+	errno = EINVAL;
+	return 0;
+    }
+    iconv_close(cd);
+    ctx->codec = codeciconv;
+    ctx->detectbom = 0;
+    ctx->encoding = strdup(name);
+    return ctx->encoding != NULL;
+}
+
+/*
+ * Read-ahead.
+ */
+
+#ifdef USE_IO_URING
+
+/* Make an io_uring system call. (The C library provides no wrappers.)
+ */
+static int uringsetup(unsigned int entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringenter(int fd, unsigned int submit, unsigned int wait)
+{
+    return syscall(__NR_io_uring_enter, fd, submit, wait,
+		   wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/* Create an io_uring instance for the read-ahead buffers, and map its
+ * rings into memory. The return value is false if io_uring is not
+ * available, or lacks the features needed.
+ */
+static int uringinit(prefetch *ra)
+{
+    struct io_uring_params params;
+    char  *sq, *cq;
+
+    memset(&params, 0, sizeof params);
+    ra->ring = uringsetup(readaheadcount, &params);
+    if (ra->ring < 0)
+	return 0;
+    if (!(params.features & IORING_FEAT_RW_CUR_POS))
+	goto failure;
+    ra->sqsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ra->cqsize = params.cq_off.cqes
+			+ params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+	if (ra->cqsize > ra->sqsize)
+	    ra->sqsize = ra->cqsize;
+	ra->cqsize = 0;
+    }
+    ra->sqmap = mmap(NULL, ra->sqsize, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, ra->ring, IORING_OFF_SQ_RING);
+    if (ra->sqmap == MAP_FAILED)
+	goto failure;
+    ra->cqmap = ra->sqmap;
+    if (ra->cqsize) {
+	ra->cqmap = mmap(NULL, ra->cqsize, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ra->ring, IORING_OFF_CQ_RING);
+	if (ra->cqmap == MAP_FAILED)
+	    goto unmapsq;
+    }
+    ra->sqecount = params.sq_entries;
+    ra->sqes = mmap(NULL, ra->sqecount * sizeof *ra->sqes,
+		    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    ra->ring, IORING_OFF_SQES);
+    if (ra->sqes == MAP_FAILED)
+	goto unmapcq;
+
+    sq = ra->sqmap;
+    cq = ra->cqmap;
+    ra->sqtail = (unsigned*)(sq + params.sq_off.tail);
+    ra->sqmask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ra->sqarray = (unsigned*)(sq + params.sq_off.array);
+    ra->cqhead = (unsigned*)(cq + params.cq_off.head);
+    ra->cqtail = (unsigned*)(cq + params.cq_off.tail);
+    ra->cqmask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ra->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 1;
+
+  unmapcq:
+    if (ra->cqsize)
+	munmap(ra->cqmap, ra->cqsize);
+  unmapsq:
+    munmap(ra->sqmap, ra->sqsize);
+  failure:
+    close(ra->ring);
+    ra->ring = -1;
+    return 0;
+}
+
+/* Release the io_uring instance.
+ */
+static void uringfree(prefetch *ra)
+{
+    munmap(ra->sqes, ra->sqecount * sizeof *ra->sqes);
+    if (ra->cqsize)
+	munmap(ra->cqmap, ra->cqsize);
+    munmap(ra->sqmap, ra->sqsize);
+    close(ra->ring);
+}
+
+/* Submit a read into the given buffer, at the buffer's offset if the
+ * file can seek, or else at the file's current position.
+ */
+static void uringqueue(prefetch *ra, int i)
+{
+    struct io_uring_sqe *sqe;
+    readbuf  *buf = &ra->bufs[i];
+    unsigned  tail, n;
+
+    tail = *ra->sqtail;
+    n = tail & *ra->sqmask;
+    sqe = &ra->sqes[n];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = ra->fd;
+    sqe->addr = (unsigned long)buf->data;
+    sqe->len = inbufsize;
+    sqe->off = ra->seekable ? (unsigned long long)buf->offset : -1ULL;
+    sqe->user_data = i;
+    ra->sqarray[n] = n;
+    __atomic_store_n(ra->sqtail, tail + 1, __ATOMIC_RELEASE);
+    buf->state = bufpending;
+    ++ra->pending;
+    while (uringenter(ra->ring, 1, 0) < 0 && errno == EINTR) ;
+}
+
+/* Queue reads into every idle buffer, in order after the last one
+ * queued. A file that cannot seek has only one read outstanding at a
+ * time, since the order in which the reads complete would be
+ * unpredictable.
+ */
+static void uringsubmit(prefetch *ra)
+{
+    while (!ra->ended && ra->bufs[ra->fill].state == bufidle
+		      && (ra->seekable || !ra->pending)) {
+	ra->bufs[ra->fill].offset = ra->nextoffset;
+	ra->nextoffset += inbufsize;
+	uringqueue(ra, ra->fill);
+	ra->fill = (ra->fill + 1) % readaheadcount;
+    }
+}
+
+/* Wait for at least one read to complete, and collect the results of
+ * all reads that have completed. Reads that fail with EINTR or EAGAIN
+ * are queued again.
+ */
+static void uringwait(prefetch *ra)
+{
+    struct io_uring_cqe *cqe;
+    readbuf  *buf;
+    unsigned  head;
+
+    head = *ra->cqhead;
+    if (head == __atomic_load_n(ra->cqtail, __ATOMIC_ACQUIRE))
+	uringenter(ra->ring, 0, 1);
+    while (head != __atomic_load_n(ra->cqtail, __ATOMIC_ACQUIRE)) {
+	cqe = &ra->cqes[head & *ra->cqmask];
+	buf = &ra->bufs[cqe->user_data];
+	--ra->pending;
+	++head;
+	__atomic_store_n(ra->cqhead, head, __ATOMIC_RELEASE);
+	if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+	    uringqueue(ra, buf - ra->bufs);
+	} else {
+	    buf->len = cqe->res < 0 ? 0 : cqe->res;
+	    buf->err = cqe->res < 0 ? -cqe->res : 0;
+	    buf->state = bufready;
+	}
+    }
+}
+
+/* Discard the reads that were queued after a short read, which start
+ * at the wrong offsets, so that reading can resume where it ended.
+ */
+static void uringresync(prefetch *ra, off_t offset)
+{
+    int i;
+
+    while (ra->pending)
+	uringwait(ra);
+    for (i = 0 ; i < readaheadcount ; ++i)
+	if (i != ra->head)
+	    ra->bufs[i].state = bufidle;
+    ra->fill = (ra->head + 1) % readaheadcount;
+    ra->nextoffset = offset;
+}
+
+#endif
+
+/* The body of the read-ahead thread, which is used when io_uring is
+ * not available: fill the buffers in order with read(), waiting
+ * whenever they are all full, until the end of the file or an error.
+ * The thread can be cancelled only while it is blocked in read().
+ */
+static void *readaheadthread(void *arg)
+{
+    prefetch  *ra = arg;
+    readbuf   *buf;
+    int        n;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    pthread_mutex_lock(&ra->lock);
+    while (!ra->quit) {
+	buf = &ra->bufs[ra->fill];
+	if (buf->state != bufidle) {
+	    pthread_cond_wait(&ra->cond, &ra->lock);
+	    continue;
+	}
+	pthread_mutex_unlock(&ra->lock);
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	do
+	    n = read(ra->fd, buf->data, inbufsize);
+	while (n < 0 && errno == EINTR);
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_mutex_lock(&ra->lock);
+	buf->len = n < 0 ? 0 : n;
+	buf->err = n < 0 ? errno : 0;
+	buf->state = bufready;
+	ra->fill = (ra->fill + 1) % readaheadcount;
+	pthread_cond_broadcast(&ra->cond);
+	if (n <= 0)
+	    break;
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+
+/* Begin reading the current file ahead of the decoder, starting at
+ * its current position, using io_uring if possible and a thread
+ * otherwise. The return value is false if neither is available, in
+ * which case the file is read directly.
+ */
+static int readaheadstart(state *s)
+{
+    prefetch   *ra;
+    struct stat st;
+    int         i;
+
+    ra = calloc(1, sizeof *ra);
+    if (!ra)
+	return 0;
+    ra->bufs = calloc(readaheadcount, sizeof *ra->bufs);
+    if (!ra->bufs)
+	goto failure;
+    for (i = 0 ; i < readaheadcount ; ++i) {
+	ra->bufs[i].data = malloc(inbufsize);
+	if (!ra->bufs[i].data)
+	    goto failure;
+    }
+    ra->fd = s->currentfd;
+    ra->seekable = !fstat(ra->fd, &st) && S_ISREG(st.st_mode);
+    ra->nextoffset = s->readpos;
+#ifdef USE_IO_URING
+    if (uringinit(ra)) {
+	s->ahead = ra;
+	return 1;
+    }
+#endif
+    ra->ring = -1;
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+    if (!pthread_create(&ra->thread, NULL, readaheadthread, ra)) {
+	s->ahead = ra;
+	return 1;
+    }
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->lock);
+
+  failure:
+    if (ra->bufs)
+	for (i = 0 ; i < readaheadcount ; ++i)
+	    free(ra->bufs[i].data);
+    free(ra->bufs);
+    free(ra);
+    return 0;
+}
+
+/* Stop reading ahead of the current file and free the buffers.
+ */
+static void readaheadstop(state *s)
+{
+    prefetch  *ra = s->ahead;
+    int        i;
+
+    if (!ra)
+	return;
+#ifdef USE_IO_URING
+    if (ra->ring >= 0) {
+	while (ra->pending)
+	    uringwait(ra);
+	uringfree(ra);
+    } else
+#endif
+    {
+	pthread_mutex_lock(&ra->lock);
+	ra->quit = 1;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+	pthread_cancel(ra->thread);
+	pthread_join(ra->thread, NULL);
+	pthread_cond_destroy(&ra->cond);
+	pthread_mutex_destroy(&ra->lock);
+    }
+    for (i = 0 ; i < readaheadcount ; ++i)
+	free(ra->bufs[i].data);
+    free(ra->bufs);
+    free(ra);
+    s->ahead = NULL;
+}
+
+/* Copy up to size bytes of the current file into dest from the
+ * read-ahead buffers, waiting for a read to complete if necessary.
+ * The return value is the same as that of read().
+ */
+static int readaheadread(state *s, char *dest, int size)
+{
+    prefetch  *ra = s->ahead;
+    readbuf   *buf;
+    int        n;
+
+    buf = &ra->bufs[ra->head];
+#ifdef USE_IO_URING
+    if (ra->ring >= 0) {
+	uringsubmit(ra);
+	while (buf->state != bufready)
+	    uringwait(ra);
+    } else
+#endif
+    {
+	pthread_mutex_lock(&ra->lock);
+	while (buf->state != bufready)
+	    pthread_cond_wait(&ra->cond, &ra->lock);
+	pthread_mutex_unlock(&ra->lock);
+    }
+    if (buf->err) {
+	errno = buf->err;
+	return -1;
+    }
+    if (!buf->len) {
+	ra->ended = 1;
+	return 0;
+    }
+
+    n = buf->len - ra->used < size ? buf->len - ra->used : size;
+    memcpy(dest, buf->data + ra->used, n);
+    ra->used += n;
+    if (ra->used == buf->len) {
+#ifdef USE_IO_URING
+	if (ra->ring >= 0 && ra->seekable && buf->len < inbufsize)
+	    uringresync(ra, buf->offset + buf->len);
+#endif
+	ra->used = 0;
+	if (ra->ring >= 0) {
+	    buf->state = bufidle;
+	} else {
+	    pthread_mutex_lock(&ra->lock);
+	    buf->state = bufidle;
+	    pthread_cond_broadcast(&ra->cond);
+	    pthread_mutex_unlock(&ra->lock);
+	}
+	ra->head = (ra->head + 1) % readaheadcount;
+    }
+    return n;
+}
+
+/*
+ * Decompression.
+ */
+
+#ifdef USE_DECOMPRESSION
+
+/* The signatures of the compressed formats that can be decompressed.
+ */
+static struct {
+    char const *bytes;	/* the first bytes of a compressed file */
+    int len;		/* the length of the signature */
+    int format;		/* the format that the signature identifies */
+} const compressmagics[] = {
+#ifdef USE_ZLIB
+    { "\x1F\x8B\x08", 3, compressgzip },
+#endif
+#ifdef USE_LZMA
+    { "\xFD" "7zXZ\0", 6, compressxz },
+#endif
+#ifdef USE_ZSTD
+    { "\x28\xB5\x2F\xFD", 4, compresszstd },
+#endif
+};
+
+/* Return the compressed format identified by the first len bytes at
+ * p, or compressnone if they are not compressed, or -1 if the bytes so
+ * far are a prefix of a signature and more may follow.
+ */
+static int compressionof(char const *p, int len, int atend)
+{
+    int i, format;
+
+    format = compressnone;
+    for (i = 0 ; i < (int)(sizeof compressmagics / sizeof *compressmagics)
+		 ; ++i) {
+	if (len >= compressmagics[i].len) {
+	    if (!memcmp(p, compressmagics[i].bytes, compressmagics[i].len))
+		return compressmagics[i].format;
+	} else if (!atend && !memcmp(p, compressmagics[i].bytes, len)) {
+	    format = -1;
+	}
+    }
+    return format;
+}
+
+/* Read the next compressed bytes into the input buffer, starting with
+ * any that were read before the thread started. Until output is
+ * produced, the bytes of a pipe are also kept, while there is room for
+ * them, so that they can be dumped as they are if decompression fails.
+ * The thread can be cancelled while it is blocked in read(). The
+ * return value is the same as that of read().
+ */
+static int decompressread(decompressor *dc)
+{
+    int n, err;
+
+    if (dc->headlen) {
+	memcpy(dc->in, dc->head, dc->headlen);
+	n = dc->headlen;
+	dc->headlen = 0;
+    } else {
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	do
+	    n = read(dc->fd, dc->in, dc->keeping && dc->keptlen < inbufsize
+					? inbufsize - dc->keptlen : inbufsize);
+	while (n < 0 && errno == EINTR);
+	err = errno;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	errno = err;
+    }
+    if (n > 0 && dc->keeping) {
+	if (dc->keptlen + n <= inbufsize) {
+	    memcpy(dc->kept + dc->keptlen, dc->in, n);
+	    dc->keptlen += n;
+	} else {
+	    dc->keeping = 0;
+	}
+    }
+    return n;
+}
+
+/* Write the size decompressed bytes in the output buffer to the
+ * socket. The thread can be cancelled while it is blocked in send().
+ * The return value is zero on success, or an error number.
+ */
+static int decompresswrite(decompressor *dc, size_t size)
+{
+    size_t done;
+    long   n;
+    int    err;
+
+    err = 0;
+    if (size)
+	dc->keeping = 0;
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    for (done = 0 ; done < size ; done += n) {
+	n = send(dc->sock, dc->out + done, size - done, MSG_NOSIGNAL);
+	if (n < 0) {
+	    n = 0;
+	    if (errno != EINTR) {
+		err = errno;
+		break;
+	    }
+	}
+    }
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    return err;
+}
+
+#ifdef USE_ZLIB
+
+/* Free the state of the gzip decoder.
+ */
+static void gunzipfree(void *zs)
+{
+    inflateEnd(zs);
+}
+
+/* Decompress a gzip file, which may consist of several members one
+ * after another. The return value is zero on success, or an error
+ * number.
+ */
+static int gunzip(decompressor *dc)
+{
+    z_stream zs;
+    int      ret, err, full, atend, n;
+
+    memset(&zs, 0, sizeof zs);
+    if (inflateInit2(&zs, 15 + 16) != Z_OK)
+	return ENOMEM;
+    pthread_cleanup_push(gunzipfree, &zs);
+    ret = Z_OK;
+    err = full = atend = 0;
+    for (;;) {
+	if (!zs.avail_in && !full) {
+	    if (atend)
+		break;
+	    n = decompressread(dc);
+	    if (n < 0) {
+		err = errno;
+		break;
+	    }
+	    zs.next_in = (Bytef*)dc->in;
+	    zs.avail_in = n;
+	    atend = n == 0;
+	    continue;
+	}
+	if (ret == Z_STREAM_END)
+	    inflateReset(&zs);
+	zs.next_out = (Bytef*)dc->out;
+	zs.avail_out = inbufsize;
+	ret = inflate(&zs, Z_NO_FLUSH);
+	if (ret == Z_BUF_ERROR)
+	    ret = Z_OK;
+	if (ret != Z_OK && ret != Z_STREAM_END) {
+	    err = ret == Z_MEM_ERROR ? ENOMEM : EBADMSG;
+	    break;
+	}
+	full = ret == Z_OK && !zs.avail_out;
+	err = decompresswrite(dc, inbufsize - zs.avail_out);
+	if (err)
+	    break;
+    }
+    if (!err && ret != Z_STREAM_END)
+	err = EBADMSG;
+    pthread_cleanup_pop(1);
+    return err;
+}
+
+#endif
+
+#ifdef USE_LZMA
+
+/* Free the state of the xz decoder.
+ */
+static void unxzfree(void *strm)
+{
+    lzma_end(strm);
+}
+
+/* Decompress an xz file, which may consist of several streams one
+ * after another. The return value is zero on success, or an error
+ * number.
+ */
+static int unxz(decompressor *dc)
+{
+    lzma_stream strm = LZMA_STREAM_INIT;
+    lzma_ret    ret;
+    int         err, full, atend, n;
+
+    if (lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+	return ENOMEM;
+    pthread_cleanup_push(unxzfree, &strm);
+    err = full = atend = 0;
+    for (;;) {
+	if (!strm.avail_in && !full && !atend) {
+	    n = decompressread(dc);
+	    if (n < 0) {
+		err = errno;
+		break;
+	    }
+	    strm.next_in = (uint8_t const*)dc->in;
+	    strm.avail_in = n;
+	    atend = n == 0;
+	}
+	strm.next_out = (uint8_t*)dc->out;
+	strm.avail_out = inbufsize;
+	ret = lzma_code(&strm, atend ? LZMA_FINISH : LZMA_RUN);
+	if (ret != LZMA_OK && ret != LZMA_STREAM_END) {
+	    err = ret == LZMA_MEM_ERROR ? ENOMEM : EBADMSG;
+	    break;
+	}
+	err = decompresswrite(dc, inbufsize - strm.avail_out);
+	if (err || ret == LZMA_STREAM_END)
+	    break;
+	full = !strm.avail_out;
+    }
+    pthread_cleanup_pop(1);
+    return err;
+}
+
+#endif
+
+#ifdef USE_ZSTD
+
+/* Free the state of the zstd decoder.
+ */
+static void unzstdfree(void *zd)
+{
+    ZSTD_freeDStream(zd);
+}
+
+/* Decompress a zstd file, which may consist of several frames one
+ * after another. Skippable frames, such as the seek table of the
+ * seekable format, are passed over. The return value is zero on
+ * success, or an error number.
+ */
+static int unzstd(decompressor *dc)
+{
+    ZSTD_DStream  *zd;
+    ZSTD_inBuffer  in;
+    ZSTD_outBuffer out;
+    size_t         ret;
+    int            err, full, n;
+
+    zd = ZSTD_createDStream();
+    if (!zd)
+	return ENOMEM;
+    pthread_cleanup_push(unzstdfree, zd);
+    ZSTD_initDStream(zd);
+    in.src = dc->in;
+    in.size = in.pos = 0;
+    ret = 1;
+    err = full = 0;
+    for (;;) {
+	if (in.pos == in.size && !full) {
+	    n = decompressread(dc);
+	    if (n < 0) {
+		err = errno;
+		break;
+	    }
+	    if (!n)
+		break;
+	    in.size = n;
+	    in.pos = 0;
+	}
+	out.dst = dc->out;
+	out.size = inbufsize;
+	out.pos = 0;
+	ret = ZSTD_decompressStream(zd, &out, &in);
+	if (ZSTD_isError(ret)) {
+	    err = EBADMSG;
+	    break;
+	}
+	err = decompresswrite(dc, out.pos);
+	if (err)
+	    break;
+	full = out.pos == out.size;
+    }
+    if (!err && ret)
+	err = EBADMSG;
+    pthread_cleanup_pop(1);
+    return err;
+}
+
+#endif
+
+/* The body of the decompressing thread: decompress the file into the
+ * socket, and then shut down the socket for writing, so that its
+ * reader sees the end of the file. The thread can be cancelled only
+ * while it is blocked reading or writing.
+ */
+static void *decompressthread(void *arg)
+{
+    decompressor *dc = arg;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    switch (dc->format) {
+#ifdef USE_ZLIB
+      case compressgzip:	dc->err = gunzip(dc);	break;
+#endif
+#ifdef USE_LZMA
+      case compressxz:		dc->err = unxz(dc);	break;
+#endif
+#ifdef USE_ZSTD
+      case compresszstd:	dc->err = unzstd(dc);	break;
+#endif
+    }
+    shutdown(dc->sock, SHUT_WR);
+    return NULL;
+}
+
+/* Examine the first bytes of the current file, and if they show that
+ * it is compressed, start decompressing it, with one end of a socket
+ * pair taking the place of its descriptor. A file that cannot be read
+ * at an offset has its first bytes read, and either handed to the
+ * thread or left in the byte buffer. Nothing is returned until the
+ * first decompressed bytes are available, and if decompression fails
+ * before that, the file is dumped as it is instead: from its start,
+ * or from the bytes that the thread kept.
+ */
+static void decompressstart(state *s)
+{
+    decompressor *dc;
+    char          head[maxmagiclen];
+    int           sv[2];
+    int           format, seekable, len, n;
+
+    len = pread(s->currentfd, head, sizeof head, 0);
+    seekable = len >= 0;
+    if (!seekable) {
+	for (len = 0 ; len < maxmagiclen && compressionof(head, len, 0) < 0
+		     ; len += n) {
+	    do
+		n = read(s->currentfd, head + len, maxmagiclen - len);
+	    while (n < 0 && errno == EINTR);
+	    if (n <= 0) {
+		if (n < 0)
+		    s->inputerr = errno;
+		break;
+	    }
+	}
+    }
+    format = compressionof(head, len, 1);
+    if (format == compressnone) {
+	if (!seekable) {
+	    memcpy(s->bytes, head, len);
+	    s->readpos = s->bytecount = len;
+	    s->prefetched = len > 0;
+	    addstat(s->ctx, statbytesread, len);
+	}
+	return;
+    }
+
+    dc = calloc(1, sizeof *dc);
+    if (!dc || !(dc->in = malloc(inbufsize)) || !(dc->out = malloc(inbufsize)))
+	die("out of memory");
+    dc->format = format;
+    dc->fd = s->currentfd;
+    if (!seekable) {
+	memcpy(dc->head, head, len);
+	dc->headlen = len;
+	dc->kept = malloc(inbufsize);
+	if (!dc->kept)
+	    die("out of memory");
+	dc->keeping = 1;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+	s->inputerr = errno;
+	goto failure;
+    }
+    dc->sock = sv[1];
+    n = pthread_create(&dc->thread, NULL, decompressthread, dc);
+    if (n) {
+	s->inputerr = n;
+	close(sv[0]);
+	close(sv[1]);
+	goto failure;
+    }
+
+    do
+	n = recv(sv[0], head, 1, MSG_PEEK);
+    while (n < 0 && errno == EINTR);
+    if (n == 0) {
+	pthread_join(dc->thread, NULL);
+	dc->joined = 1;
+	if (dc->err && (seekable || dc->keeping)) {
+	    close(sv[0]);
+	    close(sv[1]);
+	    if (seekable) {
+		lseek(dc->fd, 0, SEEK_SET);
+	    } else {
+		memcpy(s->bytes, dc->kept, dc->keptlen);
+		s->readpos = s->bytecount = dc->keptlen;
+		s->prefetched = dc->keptlen > 0;
+		addstat(s->ctx, statbytesread, dc->keptlen);
+	    }
+	    goto failure;
+	}
+    }
+    s->currentfd = sv[0];
+    s->unpack = dc;
+    s->noahead = 1;
+    return;
+
+  failure:
+    free(dc->kept);
+    free(dc->in);
+    free(dc->out);
+    free(dc);
+}
+
+/* Stop decompressing the current file, and close the compressed file.
+ * An error that stopped the decompression becomes the current file's
+ * error, since any problem found in decoding what came before it is
+ * likely to be a result of it. The socket taking the place of the file
+ * is left open.
+ */
+static void decompressstop(state *s)
+{
+    decompressor *dc = s->unpack;
+
+    if (!dc)
+	return;
+    if (!dc->joined) {
+	pthread_cancel(dc->thread);
+	pthread_join(dc->thread, NULL);
+    }
+    if (dc->err)
+	s->inputerr = dc->err;
+    close(dc->sock);
+    if (dc->fd != STDIN_FILENO)
+	close(dc->fd);
+    free(dc->kept);
+    free(dc->in);
+    free(dc->out);
+    free(dc);
+    s->unpack = NULL;
+}
+
+#endif
+
+/*
+ * Line buffers.
+ */
+
+/* Return the number of characters that are rendered together in the
+ * output format: a line of a text dump, or a block of a binary dump or
+ * of records (which are not grouped into lines).
+ */
+static int unitsize(chd_context const *ctx)
+{
+    return ctx->outputformat == formatbin || ctx->outputformat == formatjsonl
+					  || ctx->outputformat == formatcsv
+		? binblocksize : ctx->linesize;
+}
+
+/* Return the size of the buffer that holds one line of a text dump
+ * being read, the longest that a valid dump can have: a 16-digit
+ * address, a field for each character, the characters (each perhaps
+ * followed by a space), and the newline.
+ */
+static int undumplinelen(chd_context const *ctx)
+{
+    return 8 * ctx->linesize + 32;
+}
+
+/* Return the number of bytes of arena used by the buffers of a dump
+ * target: a line or block, the last line translated, and the previous
+ * full line (for --autoskip).
+ */
+static size_t targetspan(chd_context const *ctx)
+{
+    return arenaspan(unitsize(ctx) * sizeof(wchar_t))
+	 + 2 * arenaspan(ctx->linesize * sizeof(wchar_t));
+}
+
+/* Return the number of bytes of arena used by dumping: a line or
+ * block, the previous full line, and the lines held by --match.
+ */
+static size_t dumpspan(chd_context const *ctx)
+{
+    return arenaspan(unitsize(ctx) * sizeof(wchar_t))
+	 + arenaspan(ctx->linesize * sizeof(wchar_t))
+	 + arenaspan((size_t)ctx->context * ctx->linesize * sizeof(wchar_t))
+	 + arenaspan(ctx->context * sizeof(heldline));
+}
+
+/* Return the number of bytes of arena used by undumping: the line
+ * being read, and a dump target.
+ */
+static size_t undumpspan(chd_context const *ctx)
+{
+    return arenaspan(undumplinelen(ctx) * sizeof(wchar_t))
+	 + targetspan(ctx);
+}
+
+/*
+ * File I/O.
+ */
+
+/* Allocate the buffers used for reading and decoding input, the
+ * converter, if the input encoding needs one, and the arena of line
+ * buffers, sized for dumping or (when looking for binary dumps, as only
+ * undumping does) for undumping.
+ */
+static void inputalloc(state *s)
+{
+    s->bytes = malloc(inbufsize);
+    s->chars = malloc(inbufsize * sizeof *s->chars);
+    if (!s->bytes || !s->chars)
+	die("out of memory");
+    s->iconv = (iconv_t)-1;
+    if (s->ctx->codec == codeciconv) {
+	s->iconv = iconv_open("WCHAR_T", s->ctx->encoding);
+	if (s->iconv == (iconv_t)-1)
+	    die("%s: %s", s->ctx->encoding, strerror(errno));
+    }
+    arenainit(&s->lines, s->ctx->detectbinary ? undumpspan(s->ctx)
+					      : dumpspan(s->ctx));
+    s->bytecount = 0;
+    s->charcount = 0;
+    s->charpos = 0;
+    s->blockpos = 0;
+}
+
+/* Free the buffers and the converter allocated by inputalloc().
+ */
+static void inputfree(state *s)
+{
+    free(s->bytes);
+    free(s->chars);
+    if (s->iconv != (iconv_t)-1)
+	iconv_close(s->iconv);
+    arenafree(&s->lines);
+}
+
+/* Map the current input file into memory, if it is a regular file
+ * and memory-mapped input is enabled. Standard input is always read
+ * as a stream. Input supplied in memory is used as if it were mapped.
+ */
+static void inputmap(state *s)
+{
+    struct stat st;
+    void *map;
+
+    s->map = NULL;
+    if (s->memory) {
+	s->map = s->memory;
+	s->mapsize = s->memorysize;
+	return;
+    }
+    if (!s->ctx->usemmap || s->currentfd < 0 || s->currentfd == STDIN_FILENO)
+	return;
+    if (fstat(s->currentfd, &st) || !S_ISREG(st.st_mode) || st.st_size <= 0
+				 || (off_t)(size_t)st.st_size != st.st_size)
+	return;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, s->currentfd, 0);
+    if (map == MAP_FAILED)
+	return;
+    posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+    s->map = map;
+    s->mapsize = st.st_size;
+}
+
+/* Return the codec selected by a byte order mark among the first len
+ * bytes at p, or the current file's codec if there is none, or -1 if
+ * the bytes so far are a prefix of a mark and more may follow.
+ */
+static int detectbom(state *s, char const *p, int len, int atend)
+{
+    int i;
+
+    for (i = 0 ; i < (int)(sizeof byteordermarks / sizeof *byteordermarks)
+		 ; ++i) {
+	if (!(byteordermarks[i].family & s->ctx->detectbom))
+	    continue;
+	if (len >= byteordermarks[i].len) {
+	    if (!memcmp(p, byteordermarks[i].bytes, byteordermarks[i].len))
+		return byteordermarks[i].codec;
+	} else if (!atend && !memcmp(p, byteordermarks[i].bytes, len)) {
+	    return -1;
+	}
+    }
+    return s->codec;
+}
+
+/* Examine the first len bytes at p of the current file, to decide
+ * whether it is a binary dump, and whether a byte order mark selects
+ * its codec. If the bytes so far are a prefix of the signature or of
+ * a mark and more may follow, the decision is put off.
+ */
+static void detectinput(state *s, char const *p, int len, int atend)
+{
+    int codec;
+
+    codec = detectbom(s, p, len, atend);
+    if (codec < 0)
+	return;
+    if (s->ctx->detectbinary && len < 8 && !atend
+			     && !memcmp(p, binmagic, len))
+	return;
+    s->codec = codec;
+    s->binary = s->ctx->detectbinary && len >= 8
+				     && !memcmp(p, binmagic, 8);
+    s->detecting = 0;
+}
+
+/* Prepare the current input file, if necessary. (Does nothing if the
+ * current input file is already open and is not at the end.) Any
+ * errors that occur when opening a file are reported to stderr before
+ * moving on to the next input file. Input that is not from a file has
+ * no descriptor, and is never read ahead or followed. A compressed
+ * file is decompressed as it is read, unless it is being followed. The
+ * return value is zero if no more input files are available.
+ */
+static int inputinit(state *s)
+{
+    if (s->currentfd == -1) {
+	if (!*s->filenames)
+	    return 0;
+	if (s->memory || s->reader) {
+	    s->currentfd = nofd;
+	} else if (!strcmp(*s->filenames, "-")) {
+	    s->currentfd = STDIN_FILENO;
+	    *s->filenames = "stdin";
+	} else {
+	    s->currentfd = open(*s->filenames, O_RDONLY);
+	}
+	if (s->currentfd == -1) {
+	    fail(s);
+	    ++s->filenames;
+	    return inputinit(s);
+	}
+	memset(&s->mbs, 0, sizeof s->mbs);
+	if (s->iconv != (iconv_t)-1)
+	    iconv(s->iconv, NULL, NULL, NULL, NULL);
+	s->inputerr = 0;
+	s->readpos = 0;
+	s->bytecount = 0;
+	s->prefetched = 0;
+	s->ahead = NULL;
+	s->noahead = s->injob || s->currentfd == nofd;
+	s->following = s->ctx->followinput && !s->filenames[1]
+					   && s->currentfd != nofd;
+	s->stalled = 0;
+	s->watchfd = -1;
+	s->binary = 0;
+	s->codec = s->ctx->codec;
+	s->detecting = s->ctx->detectbinary || s->ctx->detectbom;
+	s->unpack = NULL;
+#ifdef USE_DECOMPRESSION
+	if (s->currentfd != nofd && !s->following && s->ctx->decompress)
+	    decompressstart(s);
+#endif
+	if (s->following)
+	    s->noahead = 1;
+	else
+	    inputmap(s);
+	if (s->map && s->detecting)
+	    detectinput(s, s->map, s->mapsize < 8 ? s->mapsize : 8, 1);
+    }
+    return 1;
+}
+
+/* Release everything but the descriptor of the current input file:
+ * its read-ahead buffers, its decompression, its inotify watch and
+ * its mapping.
+ */
+static void inputrelease(state *s)
+{
+    readaheadstop(s);
+#ifdef USE_DECOMPRESSION
+    decompressstop(s);
+#endif
+    if (s->watchfd >= 0)
+	close(s->watchfd);
+    s->watchfd = -1;
+    if (s->map && !s->memory)
+	munmap((void*)s->map, s->mapsize);
+    s->map = NULL;
+}
+
+/* Close the current input file, reporting errors if any to stderr.
+ */
+static void inputupdate(state *s)
+{
+    inputrelease(s);
+    if (s->inputerr) {
+	errno = s->inputerr;
+	fail(s);
+	if (s->currentfd >= 0)
+	    close(s->currentfd);
+    } else {
+	if (s->currentfd >= 0 && s->currentfd != STDIN_FILENO)
+	    if (close(s->currentfd))
+		fail(s);
+    }
+    s->currentfd = -1;
+    ++s->filenames;
+}
+
+/* Convert len bytes of input at src into characters, appending them
+ * to the character buffer. The return value is the number of bytes
+ * consumed. Bytes at the end of the input that form an incomplete
+ * sequence are left unconsumed, unless atend is true, in which case
+ * they are treated as invalid. If an invalid byte sequence is
+ * encountered and acceptbadchars is true, then a single byte is
+ * consumed, and the character is the value of the octet ORed with the
+ * rawbyte flag. Otherwise, decoding stops, the error is recorded, and
+ * all of the input is considered consumed.
+ */
+static int decodembs(state *s, char const *src, int len, int atend)
+{
+    mbstate_t   saved;
+    wchar_t     wc;
+    size_t      n;
+    int         i;
+
+    for (i = 0 ; i < len ; i += n) {
+	saved = s->mbs;
+	n = mbrtowc(&wc, src + i, len - i, &s->mbs);
+	if (n == (size_t)-2 && !atend) {
+	    s->mbs = saved;
+	    break;
+	}
+	if (n == (size_t)-1 || n == (size_t)-2) {
+	    if (!s->ctx->acceptbadchars) {
+		s->inputerr = EILSEQ;
+		return len;
+	    }
+	    memset(&s->mbs, 0, sizeof s->mbs);
+	    wc = rawbyte | (unsigned char)src[i];
+	    addstat(s->ctx, statrawbytes, 1);
+	    n = 1;
+	} else if (n == 0) {
+	    n = 1;
+	}
+	s->chars[s->charcount++] = wc;
+    }
+    return i;
+}
+
+/* Convert len bytes of input at src into characters, exactly as
+ * decodembs() does, but using the built-in UTF-8 decoder. Runs of
+ * ASCII bytes are widened in bulk by asciirun().
+ */
+static int decodeutf8(state *s, char const *src, int len, int atend)
+{
+    unsigned char const *p, *end;
+    wchar_t     *out;
+    int         n;
+
+    p = (unsigned char const*)src;
+    end = p + len;
+    out = s->chars + s->charcount;
+    while (p < end) {
+	if (*p < 0x80) {
+	    n = asciirun(p, end - p, out);
+	    p += n;
+	    out += n;
+	    while (p < end && *p < 0x80)
+		*out++ = *p++;
+	}
+	if (p == end)
+	    break;
+	n = utf8decode(p, end - p, out);
+	if (n == 0 && !atend)
+	    break;
+	if (n <= 0) {
+	    if (!s->ctx->acceptbadchars) {
+		s->charcount = out - s->chars;
+		s->inputerr = EILSEQ;
+		return len;
+	    }
+	    *out = rawbyte | *p;
+	    addstat(s->ctx, statrawbytes, 1);
+	    n = 1;
+	}
+	++out;
+	p += n;
+    }
+    s->charcount = out - s->chars;
+    return p - (unsigned char const*)src;
+}
+
+/* Convert len bytes of input at src into characters, as decodembs()
+ * does, using the context's single-byte decoding table. Every byte is
+ * consumed, and runs of ASCII bytes are widened by asciirun().
+ */
+static int decodetable(state *s, char const *src, int len)
+{
+    unsigned short const *table = s->ctx->table;
+    unsigned char const *p, *end;
+    wchar_t     *out;
+    int         n;
+
+    p = (unsigned char const*)src;
+    end = p + len;
+    out = s->chars + s->charcount;
+    while (p < end) {
+	if (*p < 0x80) {
+	    n = asciirun(p, end - p, out);
+	    p += n;
+	    out += n;
+	    while (p < end && *p < 0x80)
+		*out++ = *p++;
+	}
+	for ( ; p < end && *p >= 0x80 ; ++p, ++out) {
+	    *out = table[*p - 0x80];
+	    if (*out)
+		continue;
+	    if (!s->ctx->acceptbadchars) {
+		s->charcount = out - s->chars;
+		s->inputerr = EILSEQ;
+		return len;
+	    }
+	    *out = rawbyte | *p;
+	    addstat(s->ctx, statrawbytes, 1);
+	}
+    }
+    s->charcount = out - s->chars;
+    return len;
+}
+
+/* Convert len bytes of input at src into characters, as decodembs()
+ * does, using iconv. The conversion is done in as few calls as
+ * possible, stopping only at invalid sequences, or when the character
+ * buffer is full (in which case some of the input is left unconsumed).
+ */
+static int decodeiconv(state *s, char const *src, int len, int atend)
+{
+    char       *in, *out;
+    size_t      inleft, outleft;
+    int         i;
+
+    i = 0;
+    while (i < len && s->charcount < inbufsize) {
+	in = (char*)src + i;
+	inleft = len - i;
+	out = (char*)(s->chars + s->charcount);
+	outleft = (inbufsize - s->charcount) * sizeof *s->chars;
+	if (iconv(s->iconv, &in, &inleft, &out, &outleft) != (size_t)-1
+		|| errno == E2BIG || (errno == EINVAL && !atend)) {
+	    s->charcount = (wchar_t*)out - s->chars;
+	    i = in - src;
+	    break;
+	}
+	s->charcount = (wchar_t*)out - s->chars;
+	i = in - src;
+	if (!s->ctx->acceptbadchars) {
+	    s->inputerr = EILSEQ;
+	    return len;
+	}
+	iconv(s->iconv, NULL, NULL, NULL, NULL);
+	s->chars[s->charcount++] = rawbyte | (unsigned char)src[i++];
+	addstat(s->ctx, statrawbytes, 1);
+    }
+    return i;
+}
+
+/* Return the size in bytes of the code units of a codec.
+ */
+static int codecunit(int codec)
+{
+    if (codec == codecutf16le || codec == codecutf16be)
+	return 2;
+    if (codec == codecutf32le || codec == codecutf32be)
+	return 4;
+    return 1;
+}
+
+/* Accept the size bytes at p, making up an invalid code unit, as the
+ * next characters: with acceptbadchars true, as one raw byte for each
+ * byte; otherwise, the error is recorded. The return value is the
+ * updated output position, or NULL if an error was recorded.
+ */
+static wchar_t *badunit(state *s, unsigned char const *p, int size,
+			wchar_t *out)
+{
+    int i;
+
+    if (!s->ctx->acceptbadchars) {
+	s->charcount = out - s->chars;
+	s->inputerr = EILSEQ;
+	return NULL;
+    }
+    for (i = 0 ; i < size ; ++i)
+	*out++ = rawbyte | p[i];
+    addstat(s->ctx, statrawbytes, size);
+    return out;
+}
+
+/* Convert len bytes of input at src into characters, as decodembs()
+ * does, using the built-in UTF-16 decoder. Runs of characters outside
+ * of the surrogate range are widened in bulk by bmprun(). A surrogate
+ * that is not part of a pair is an invalid unit, whose two bytes
+ * become raw bytes under -i, as does an odd byte at the end.
+ */
+static int decodeutf16(state *s, char const *src, int len, int atend)
+{
+    unsigned char const *p, *end;
+    wchar_t     *out;
+    unsigned int u, v;
+    int         big, n;
+
+    big = s->codec == codecutf16be;
+    p = (unsigned char const*)src;
+    end = p + len;
+    out = s->chars + s->charcount;
+    while (end - p >= 2) {
+	n = bmprun(p, (end - p) / 2, big, out);
+	p += 2 * n;
+	out += n;
+	for ( ; end - p >= 2 ; p += 2) {
+	    u = big ? p[0] << 8 | p[1] : p[1] << 8 | p[0];
+	    if ((u & 0xF800) == 0xD800)
+		break;
+	    *out++ = u;
+	}
+	if (end - p < 2)
+	    break;
+	if (u < 0xDC00) {
+	    if (end - p < 4 && !atend)
+		break;
+	    if (end - p >= 4) {
+		v = big ? p[2] << 8 | p[3] : p[3] << 8 | p[2];
+		if ((v & 0xFC00) == 0xDC00) {
+		    *out++ = 0x10000 + ((u - 0xD800) << 10) + (v - 0xDC00);
+		    p += 4;
+		    continue;
+		}
+	    }
+	}
+	out = badunit(s, p, 2, out);
+	if (!out)
+	    return len;
+	p += 2;
+    }
+    if (p < end && atend) {
+	out = badunit(s, p, 1, out);
+	if (!out)
+	    return len;
+	++p;
+    }
+    s->charcount = out - s->chars;
+    return p - (unsigned char const*)src;
+}
+
+/* Convert len bytes of input at src into characters, as decodembs()
+ * does, using the built-in UTF-32 decoder. A unit that is a surrogate
+ * or beyond U+10FFFF is invalid, as are up to three bytes left over at
+ * the end.
+ */
+static int decodeutf32(state *s, char const *src, int len, int atend)
+{
+    unsigned char const *p, *end;
+    wchar_t     *out;
+    unsigned int u;
+    int         big;
+
+    big = s->codec == codecutf32be;
+    p = (unsigned char const*)src;
+    end = p + len;
+    out = s->chars + s->charcount;
+    for ( ; end - p >= 4 ; p += 4) {
+	u = big ? (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]
+		: (unsigned int)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0];
+	if (u <= 0x10FFFF && (u & 0xFFFFF800) != 0xD800) {
+	    *out++ = u;
+	    continue;
+	}
+	out = badunit(s, p, 4, out);
+	if (!out)
+	    return len;
+    }
+    if (p < end && atend) {
+	out = badunit(s, p, end - p, out);
+	if (!out)
+	    return len;
+	p = end;
+    }
+    s->charcount = out - s->chars;
+    return p - (unsigned char const*)src;
+}
+
+/* Decode len bytes of input at src using the decoder of the input
+ * encoding (as chosen for the current file), and return the number of
+ * bytes consumed. The bytes of a binary dump are instead passed
+ * through unchanged, as one character per byte.
+ */
+static int decodeinput(state *s, char const *src, int len, int atend)
+{
+    chd_context *ctx = s->ctx;
+    long long    t;
+    int          count, n;
+
+    t = stattime(ctx);
+    count = s->charcount;
+    if (s->binary) {
+	for (n = 0 ; n < len ; ++n)
+	    s->chars[s->charcount + n] = (unsigned char)src[n];
+	s->charcount += len;
+    } else if (s->codec == codecutf8) {
+	n = decodeutf8(s, src, len, atend);
+    } else if (s->codec == codectable) {
+	n = decodetable(s, src, len);
+    } else if (s->codec == codeciconv) {
+	n = decodeiconv(s, src, len, atend);
+    } else if (codecunit(s->codec) == 2) {
+	n = decodeutf16(s, src, len, atend);
+    } else if (codecunit(s->codec) == 4) {
+	n = decodeutf32(s, src, len, atend);
+    } else {
+	n = decodembs(s, src, len, atend);
+    }
+    addstat(ctx, statcharsdecoded, s->charcount - count);
+    addstat(ctx, stattimedecode, stattime(ctx) - t);
+    return n;
+}
+
+/* Wait for the current file, which has been read to its end, to
+ * grow, for at most timeout milliseconds (or indefinitely if timeout
+ * is negative). Regular files are watched with inotify if possible,
+ * and otherwise checked at intervals; other files are polled. The
+ * return value is false if the timeout expired.
+ */
+static int followwait(state *s, int timeout)
+{
+    struct pollfd pfd;
+    struct stat   st;
+    long long     deadline;
+    char          events[4096];
+    int           wait;
+
+    if (fstat(s->currentfd, &st) || !S_ISREG(st.st_mode)) {
+	pfd.fd = s->currentfd;
+	pfd.events = POLLIN;
+	return poll(&pfd, 1, timeout) != 0;
+    }
+#ifdef __linux__
+    if (s->watchfd < 0 && s->currentfd != STDIN_FILENO) {
+	s->watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (s->watchfd >= 0 && inotify_add_watch(s->watchfd, *s->filenames,
+						 IN_MODIFY) < 0) {
+	    close(s->watchfd);
+	    s->watchfd = -2;
+	}
+    }
+#endif
+    deadline = monotime() + timeout * 1000000LL;
+    for (;;) {
+	if (!fstat(s->currentfd, &st) && st.st_size > s->readpos)
+	    return 1;
+	wait = s->watchfd >= 0 ? -1 : followinterval;
+	if (timeout >= 0) {
+	    timeout = (deadline - monotime()) / 1000000;
+	    if (timeout <= 0)
+		return 0;
+	    if (wait < 0 || wait > timeout)
+		wait = timeout;
+	}
+	if (s->watchfd >= 0) {
+	    pfd.fd = s->watchfd;
+	    pfd.events = POLLIN;
+	    if (poll(&pfd, 1, wait) > 0)
+		while (read(s->watchfd, events, sizeof events) > 0) ;
+	} else {
+	    poll(NULL, 0, wait);
+	}
+    }
+}
+
+/* Read from the current file while following it. If the end of a
+ * regular file is reached, wait for it to grow. If no input arrives
+ * within waitms milliseconds, the return value is -1 with errno set
+ * to EAGAIN. Otherwise the return value is the same as read()'s.
+ */
+static int followread(state *s, char *dest, int size)
+{
+    struct stat st;
+    int         n;
+
+    if (fstat(s->currentfd, &st) || !S_ISREG(st.st_mode)) {
+	if (!followwait(s, s->waitms)) {
+	    errno = EAGAIN;
+	    return -1;
+	}
+	return read(s->currentfd, dest, size);
+    }
+    for (;;) {
+	n = read(s->currentfd, dest, size);
+	if (n)
+	    return n;
+	if (!followwait(s, s->waitms)) {
+	    errno = EAGAIN;
+	    return -1;
+	}
+    }
+}
+
+/* Read up to size bytes of the current input into dest, using its
+ * reader function if it has one. The return value is the same as
+ * that of read().
+ */
+static int readinput(state *s, char *dest, int size)
+{
+    if (s->reader)
+	return s->reader(s->readerarg, dest, size);
+    return read(s->currentfd, dest, size);
+}
+
+/* Finish examining the first bytes of the current file, if that is
+ * still pending, before its input is located or measured without
+ * going through readblock(). A file that cannot be read at an offset
+ * has its first bytes read into the byte buffer.
+ */
+static void detectstart(state *s)
+{
+    char head[8];
+    int  n;
+
+    if (!s->detecting)
+	return;
+    n = s->currentfd >= 0 ? pread(s->currentfd, head, sizeof head, 0) : -1;
+    if (n >= 0) {
+	detectinput(s, head, n, 1);
+	return;
+    }
+    while (s->detecting) {
+	do
+	    n = readinput(s, s->bytes + s->bytecount, 8 - s->bytecount);
+	while (n < 0 && errno == EINTR);
+	if (n < 0) {
+	    s->inputerr = errno;
+	    n = 0;
+	}
+	addstat(s->ctx, statbytesread, n);
+	s->readpos += n;
+	s->bytecount += n;
+	s->prefetched = s->bytecount > 0;
+	detectinput(s, s->bytes, s->bytecount, n == 0);
+    }
+}
+
+/* Read and decode the next block of input from the current file. A
+ * memory-mapped file is decoded in place; otherwise the bytes are
+ * read into the byte buffer, after any left over from the previous
+ * block; bytes read before the first block are decoded before any
+ * more are read, so that they are not held up waiting for input. If
+ * the file is exhausted, it is closed. The return value is zero if
+ * the end of the current file was reached. (Since the shift state of
+ * iconv cannot be examined, its blocks are never taken as starting
+ * in the initial state.)
+ */
+static int readblock(state *s)
+{
+    long long t;
+    int       len, n, held;
+
+    s->charpos = s->charcount = 0;
+    s->stalled = 0;
+    s->blockpos = s->readpos - s->bytecount;
+    s->blockinit = s->iconv == (iconv_t)-1 && mbsinit(&s->mbs);
+    held = s->prefetched;
+    s->prefetched = 0;
+    if (s->map) {
+	len = 0;
+	if (!s->inputerr)
+	    len = s->mapsize - s->readpos < inbufsize ?
+			s->mapsize - s->readpos : inbufsize;
+	n = decodeinput(s, s->map + s->readpos, len,
+			s->readpos + len == s->mapsize);
+	addstat(s->ctx, statbytesread, n);
+	s->readpos += n;
+	n = len;
+    } else {
+	n = 0;
+	if (!s->inputerr && !held) {
+	    if (!s->ahead && !s->noahead)
+		s->noahead = !readaheadstart(s);
+	    t = stattime(s->ctx);
+	    do
+		n = s->ahead ? readaheadread(s, s->bytes + s->bytecount,
+					     inbufsize - s->bytecount)
+		  : s->following ? followread(s, s->bytes + s->bytecount,
+					      inbufsize - s->bytecount)
+			     : readinput(s, s->bytes + s->bytecount,
+					 inbufsize - s->bytecount);
+	    while (n < 0 && errno == EINTR);
+	    addstat(s->ctx, stattimeinput, stattime(s->ctx) - t);
+	    if (n < 0 && errno == EAGAIN && s->following) {
+		s->stalled = 1;
+		return 1;
+	    }
+	    if (n > 0 && s->following)
+		s->waitms = s->ctx->latency;
+	    if (n < 0) {
+		s->inputerr = errno;
+		n = 0;
+	    }
+	}
+	addstat(s->ctx, statbytesread, n);
+	s->readpos += n;
+	s->bytecount += n;
+	if (s->detecting) {
+	    detectinput(s, s->bytes, s->bytecount < 8 ? s->bytecount : 8,
+			n == 0 && !held);
+	    if (s->detecting)
+		return 1;
+	}
+	len = decodeinput(s, s->bytes, s->bytecount, n == 0 && !held);
+	s->bytecount -= len;
+	memmove(s->bytes, s->bytes + len, s->bytecount);
+    }
+    if (!s->charcount && !n && !held) {
+	inputupdate(s);
+	return 0;
+    }
+    return 1;
+}
+
+/* Ensure that the character buffer contains unread characters. If
+ * the buffer has been exhausted, the next block of input is read and
+ * decoded, moving on to the next file in the list of filenames when
+ * the current one is finished. The return value is zero if no more
+ * input is available.
+ */
+static int fillchars(state *s)
+{
+    while (s->charpos >= s->charcount) {
+	if (!inputinit(s))
+	    return 0;
+	readblock(s);
+	if (s->stalled)
+	    return 0;
+    }
+    return 1;
+}
+
+/* Get up to count characters of input and store them in buf. Fewer
+ * than count characters may be returned even when more input
+ * remains. The return value is the number of characters retrieved,
+ * which is zero only if there is no more input.
+ */
+static int nextwchars(state *s, wchar_t *buf, int count)
+{
+    int n;
+
+    if (!fillchars(s))
+	return 0;
+    n = s->charcount - s->charpos;
+    if (n > count)
+	n = count;
+    wmemcpy(buf, s->chars + s->charpos, n);
+    s->charpos += n;
+    return n;
+}
+
+/* Get the next count characters of input for a line of dump output.
+ * If that many characters are available in the character buffer, the
+ * return value points directly into it; otherwise, the characters are
+ * copied into buf and the return value is buf. The number of
+ * characters retrieved is stored in pcount, and is less than count
+ * only at the end of the input.
+ */
+static wchar_t const *nextdumpline(state *s, wchar_t *buf, int count,
+				   int *pcount)
+{
+    wchar_t const *line;
+    int n, m;
+
+    if (fillchars(s) && s->charcount - s->charpos >= count) {
+	line = s->chars + s->charpos;
+	s->charpos += count;
+	*pcount = count;
+	return line;
+    }
+    for (n = 0 ; n < count ; n += m)
+	if (!(m = nextwchars(s, buf + n, count - n)))
+	    break;
+    *pcount = n;
+    return buf;
+}
+
+/* Get a line of text from the current file and store it in buf. At
+ * most buflen - 1 characters are stored, and a line never continues
+ * past the end of a file, which is recorded in linefile. The return
+ * value is the number of characters stored, which is zero only if no
+ * further input is available.
+ */
+static int nextwline(state *s, wchar_t *buf, int buflen)
+{
+    char      **filename;
+    wchar_t    *nl;
+    int         n, m;
+
+    filename = s->filenames;
+    for (n = 0 ; n < buflen - 1 ; n += m) {
+	if (!fillchars(s) || (n && s->filenames != filename))
+	    break;
+	filename = s->filenames;
+	m = s->charcount - s->charpos;
+	if (m > buflen - 1 - n)
+	    m = buflen - 1 - n;
+	nl = wmemchr(s->chars + s->charpos, L'\n', m);
+	if (nl)
+	    m = nl - (s->chars + s->charpos) + 1;
+	wmemcpy(buf + n, s->chars + s->charpos, m);
+	s->charpos += m;
+	if (nl) {
+	    n += m;
+	    break;
+	}
+    }
+    buf[n] = L'\0';
+    s->linefile = filename;
+    return n;
+}
+
+/*
+ * Character index files.
+ */
+
+/* Return true if every byte of input is always decoded as exactly one
+ * character, so that character offsets and byte offsets coincide. This
+ * is the case for single-byte encodings when -i is in effect, or when
+ * the encoding has no invalid bytes.
+ */
+static int issinglebyte(chd_context *ctx)
+{
+    mbstate_t   mbs;
+    wchar_t     wc;
+    size_t      n;
+    char        byte;
+    int         i;
+
+    if (ctx->codec == codectable) {
+	for (i = 0 ; i < 128 && !ctx->acceptbadchars ; ++i)
+	    if (!ctx->table[i])
+		return 0;
+	return 1;
+    }
+    if (ctx->codec != codecmbs || MB_CUR_MAX != 1)
+	return 0;
+    if (ctx->acceptbadchars)
+	return 1;
+    for (i = 0 ; i < 256 ; ++i) {
+	byte = i;
+	memset(&mbs, 0, sizeof mbs);
+	n = mbrtowc(&wc, &byte, 1, &mbs);
+	if (n == (size_t)-1 || n == (size_t)-2)
+	    return 0;
+    }
+    return 1;
+}
+
+/* Store a 64-bit value at p in little-endian order.
+ */
+static void putu64(unsigned char *p, unsigned long long value)
+{
+    int i;
+
+    for (i = 0 ; i < 8 ; ++i, value >>= 8)
+	p[i] = value & 0xFF;
+}
+
+/* Retrieve a 64-bit value stored at p in little-endian order.
+ */
+static unsigned long long getu64(unsigned char const *p)
+{
+    unsigned long long value;
+    int i;
+
+    value = 0;
+    for (i = 7 ; i >= 0 ; --i)
+	value = (value << 8) | p[i];
+    return value;
+}
+
+/* Return the name of the index file for the given input file, in
+ * freshly allocated memory.
+ */
+static char *indexfilename(char const *filename)
+{
+    char *name;
+
+    name = malloc(strlen(filename) + strlen(indexsuffix) + 1);
+    if (!name)
+	die("out of memory");
+    strcpy(name, filename);
+    strcat(name, indexsuffix);
+    return name;
+}
+
+/* Fill in the header of an index file. The header identifies the
+ * input file by its size and modification time, and records the
+ * settings that affect how it is decoded, so that an index that no
+ * longer applies can be recognized.
+ */
+static void makeindexheader(chd_context *ctx, unsigned char *header,
+			    struct stat const *st, charindex const *ix)
+{
+    memset(header, 0, indexheadersize);
+    memcpy(header, indexmagic, 8);
+    putu64(header + 8, st->st_size);
+    putu64(header + 16, st->st_mtim.tv_sec);
+    putu64(header + 24, st->st_mtim.tv_nsec);
+    putu64(header + 32, (ctx->acceptbadchars ? 1 : 0)
+			| (ix->truncated ? 2 : 0));
+    putu64(header + 40, ix->totalchars);
+    putu64(header + 48, ix->count);
+    strncpy((char*)header + 56,
+	    ctx->encoding ? ctx->encoding : nl_langinfo(CODESET),
+	    indexheadersize - 57);
+}
+
+/* Open the index for the given input file, whose status is supplied
+ * by st, and read its header into ix, leaving the entries in the file.
+ * The return value is the index file's descriptor, or -1 if the file
+ * has no index, or if the index is out of date or was made with
+ * different settings.
+ */
+static int openindex(chd_context *ctx, char const *filename,
+		     struct stat const *st, charindex *ix)
+{
+    unsigned char   header[indexheadersize], expected[indexheadersize];
+    struct stat     ixst;
+    char           *name;
+    int             fd;
+
+    name = indexfilename(filename);
+    fd = open(name, O_RDONLY);
+    free(name);
+    if (fd < 0)
+	return -1;
+    ix->entries = NULL;
+    if (pread(fd, header, indexheadersize, 0) != indexheadersize
+		|| fstat(fd, &ixst))
+	goto failure;
+    ix->totalchars = getu64(header + 40);
+    ix->count = getu64(header + 48);
+    ix->truncated = (getu64(header + 32) & 2) != 0;
+    makeindexheader(ctx, expected, st, ix);
+    if (memcmp(header, expected, indexheadersize)
+		|| ixst.st_size != indexheadersize + 16 * (off_t)ix->count)
+	goto failure;
+    return fd;
+
+  failure:
+    close(fd);
+    return -1;
+}
+
+/* Read entry number i of the index open on fd. The return value is
+ * false if the entry could not be read.
+ */
+static int readindexentry(int fd, int i, indexentry *entry)
+{
+    unsigned char buf[16];
+
+    if (pread(fd, buf, sizeof buf, indexheadersize + 16 * (off_t)i)
+		!= sizeof buf)
+	return 0;
+    entry->charpos = getu64(buf);
+    entry->bytepos = getu64(buf + 8);
+    return 1;
+}
+
+/* Write out the index for the given input file, whose status is
+ * supplied by st. Errors are reported to stderr.
+ */
+static void saveindex(chd_context *ctx, char const *filename,
+		      struct stat const *st, charindex const *ix)
+{
+    unsigned char   header[indexheadersize];
+    unsigned char   entry[16];
+    FILE           *fp;
+    char           *name;
+    int             i;
+
+    name = indexfilename(filename);
+    fp = fopen(name, "wb");
+    if (!fp) {
+	perror(name);
+	ctx->exitcode = EXIT_FAILURE;
+	free(name);
+	return;
+    }
+    makeindexheader(ctx, header, st, ix);
+    fwrite(header, indexheadersize, 1, fp);
+    for (i = 0 ; i < ix->count ; ++i) {
+	putu64(entry, ix->entries[i].charpos);
+	putu64(entry + 8, ix->entries[i].bytepos);
+	fwrite(entry, sizeof entry, 1, fp);
+    }
+    if (ferror(fp) | fclose(fp)) {
+	perror(name);
+	ctx->exitcode = EXIT_FAILURE;
+    }
+    free(name);
+}
+
+/* Find the position nearest to, but not after, count characters into
+ * the current file that can be reached without decoding: directly for
+ * single-byte input, or else from the file's index, which is searched
+ * in place so that only a few of its entries are read, however large
+ * the file. The character and byte offsets of the position are
+ * stored in pchars and pbytes, and ptruncated is set to true if the
+ * file ends with an invalid sequence. The return value is the number
+ * of characters in the file, or -1 if the file has no usable index.
+ */
+static long long lookupinput(state *s, struct stat const *st, long long count,
+			     long long *pchars, long long *pbytes,
+			     int *ptruncated)
+{
+    charindex   ix;
+    indexentry  entry;
+    int         fd, lo, hi, mid;
+
+    if (s->ctx->singlebyte) {
+	*pchars = *pbytes = count < st->st_size ? count : st->st_size;
+	*ptruncated = 0;
+	return st->st_size;
+    }
+    if (s->currentfd == STDIN_FILENO)
+	return -1;
+    fd = openindex(s->ctx, *s->filenames, st, &ix);
+    if (fd < 0)
+	return -1;
+    *pchars = *pbytes = 0;
+    lo = 0;
+    hi = ix.count;
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (!readindexentry(fd, mid, &entry)) {
+	    close(fd);
+	    return -1;
+	}
+	if (entry.charpos <= count) {
+	    *pchars = entry.charpos;
+	    *pbytes = entry.bytepos;
+	    lo = mid + 1;
+	} else {
+	    hi = mid;
+	}
+    }
+    close(fd);
+    *ptruncated = ix.truncated;
+    return ix.totalchars;
+}
+
+/* Attempt to skip over up to count characters at the start of the
+ * current input file without decoding them: for single-byte input by
+ * seeking directly, and otherwise by seeking to the last position
+ * before the target that is listed in the file's index. If the whole
+ * file is skipped, it is closed. The return value is the number of
+ * characters skipped, which is zero if no seeking was possible.
+ */
+static long long seekinput(state *s, long long count)
+{
+    struct stat st;
+    long long   total, chars, bytes;
+    int         truncated;
+
+    detectstart(s);
+    if (s->readpos || s->bytecount || fstat(s->currentfd, &st)
+		   || !S_ISREG(st.st_mode))
+	return 0;
+    total = lookupinput(s, &st, count, &chars, &bytes, &truncated);
+    if (total < 0)
+	return 0;
+    if (total <= count) {
+	s->inputerr = truncated ? EILSEQ : 0;
+	inputupdate(s);
+	return total;
+    }
+    if (!chars || (!s->map && lseek(s->currentfd, bytes, SEEK_SET) < 0))
+	return 0;
+    s->readpos = bytes;
+    return chars;
+}
+
+/* Skip over count characters of input, seeking past them where
+ * possible. The return value is the number of characters skipped,
+ * which is less than count only if the input ran out.
+ */
+static long long skipinput(state *s, long long count)
+{
+    long long done, n;
+
+    for (done = 0 ; done < count ; done += n) {
+	n = s->charcount - s->charpos;
+	if (n) {
+	    if (n > count - done)
+		n = count - done;
+	    s->charpos += n;
+	    continue;
+	}
+	if (!inputinit(s))
+	    break;
+	n = seekinput(s, count - done);
+	if (!n)
+	    readblock(s);
+    }
+    return done;
+}
+
+/*
+ * Output buffering.
+ */
+
+/* Write size bytes at buf to the context's output: to stdout, unless
+ * a writer has been supplied. Once the writer has failed, the rest of
+ * the call's output is discarded. The return value is false if the
+ * bytes could not be written.
+ */
+static int writeoutput(chd_context *ctx, char const *buf, size_t size)
+{
+    if (!ctx->writer)
+	return fwrite(buf, size, 1, stdout) == 1;
+    if (!ctx->writefailed && ctx->writer(ctx->writerarg, buf, size))
+	ctx->writefailed = 1;
+    return !ctx->writefailed;
+}
+
+/* Flush the output that stdio has buffered, if it is going to stdout.
+ */
+static void flushoutput(chd_context *ctx)
+{
+    if (!ctx->writer)
+	fflush(stdout);
+}
+
+/* Allocate an empty output buffer for the context's output.
+ */
+static void outputalloc(output *out, chd_context *ctx)
+{
+    int i;
+
+    out->ctx = ctx;
+    out->buf = malloc(outbufsize);
+    if (!out->buf)
+	die("out of memory");
+    out->len = 0;
+    out->size = outbufsize;
+    out->grow = 0;
+    memset(&out->mbs, 0, sizeof out->mbs);
+    out->cache = ctx->utf8locale || MB_CUR_MAX == 1;
+    for (i = 0 ; i < (int)(sizeof out->cells / sizeof *out->cells) ; ++i)
+	out->cells[i].ch = -1;
+}
+
+/* Write out the contents of the output buffer and empty it.
+ */
+static void outputflush(output *out)
+{
+    long long t;
+
+    if (out->len) {
+	t = stattime(out->ctx);
+	writeoutput(out->ctx, out->buf, out->len);
+	addstat(out->ctx, stattimeoutput, stattime(out->ctx) - t);
+	addstat(out->ctx, statbyteswritten, out->len);
+    }
+    out->len = 0;
+}
+
+/* Make room for at least size more bytes in the output buffer,
+ * flushing or enlarging it if necessary, and return a pointer to the
+ * free space. (A buffer too small to hold size bytes even when empty,
+ * for a very long line, is enlarged once and stays that size.)
+ */
+static char *outputreserve(output *out, int size)
+{
+    if (out->len + size > out->size) {
+	if (!out->grow)
+	    outputflush(out);
+	if (out->len + size > out->size) {
+	    out->size = 2 * (out->len + size);
+	    out->buf = realloc(out->buf, out->size);
+	    if (!out->buf)
+		die("out of memory");
+	}
+    }
+    return out->buf + out->len;
+}
+
+/* Append the encoding of a character to the output buffer. If the
+ * character cannot be represented in the current locale, the
+ * replacement character (or failing that, a question mark) is used
+ * instead. The caller is responsible for reserving MB_CUR_MAX bytes.
+ */
+static void outputchar(output *out, wchar_t ch)
+{
+    size_t n;
+
+    if (out->ctx->utf8locale) {
+	n = utf8encode(out->buf + out->len, ch);
+	if (n == (size_t)-1)
+	    n = utf8encode(out->buf + out->len, replacechar);
+	out->len += n;
+	return;
+    }
+    n = wcrtomb(out->buf + out->len, ch, &out->mbs);
+    if (n == (size_t)-1) {
+	memset(&out->mbs, 0, sizeof out->mbs);
+	n = wcrtomb(out->buf + out->len, replacechar, &out->mbs);
+	if (n == (size_t)-1) {
+	    memset(&out->mbs, 0, sizeof out->mbs);
+	    out->buf[out->len] = '?';
+	    n = 1;
+	}
+    }
+    out->len += n;
+}
+
+/* Append the sequence that returns the output to its initial shift
+ * state, followed by a single raw byte value. If raw is negative, only
+ * the shift sequence is output. The caller is responsible for
+ * reserving MB_CUR_MAX + 1 bytes.
+ */
+static void outputbyte(output *out, int raw)
+{
+    size_t n;
+
+    if (out->ctx->utf8locale) {
+	if (raw >= 0)
+	    out->buf[out->len++] = raw;
+	return;
+    }
+    n = wcrtomb(out->buf + out->len, L'\0', &out->mbs);
+    out->len += n - 1;
+    if (raw >= 0)
+	out->buf[out->len++] = raw;
+}
+
+/* Write value in hexadecimal at p, using at least width digits and
+ * padding on the left with pad. The return value points just past
+ * the last digit written.
+ */
+static char *puthex(char *p, unsigned long long value, int width, char pad)
+{
+    static char const hexdigits[] = "0123456789ABCDEF";
+    char    digits[16];
+    int     n;
+
+    n = 0;
+    do
+	digits[n++] = hexdigits[value & 15];
+    while (value >>= 4);
+    for ( ; width > n ; --width)
+	*p++ = pad;
+    while (n)
+	*p++ = digits[--n];
+    return p;
+}
+
+/* Write a value in decimal at p. The return value points just past
+ * the last digit.
+ */
+static char *putdecimal(char *p, unsigned long long value)
+{
+    char digits[20];
+    int  n;
+
+    n = 0;
+    do
+	digits[n++] = '0' + value % 10;
+    while (value /= 10);
+    while (n)
+	*p++ = digits[--n];
+    return p;
+}
+
+/*
+ * Character widths.
+ */
+
+/* How a character is displayed in the text column of a dump.
+ */
+enum { charunprintable, charnarrow, charwide, charcontrol };
+
+/* The display classes of the Unicode characters, in pages of 256
+ * characters. Each page is filled in from wcwidth() the first time it
+ * is needed. Since the rendering threads share the table, a new page
+ * is published with an atomic compare-and-swap, and a thread that
+ * loses the race simply discards its copy.
+ */
+static unsigned char *charclasses[0x110000 >> 8];
+
+/* Return the page of display classes for characters beginning at
+ * page * 256, creating it if necessary.
+ */
+static unsigned char const *charclasspage(int page)
+{
+    unsigned char *classes, *expected;
+    wchar_t        ch;
+    int            i;
+
+    classes = __atomic_load_n(&charclasses[page], __ATOMIC_ACQUIRE);
+    if (classes)
+	return classes;
+    classes = malloc(256);
+    if (!classes)
+	die("out of memory");
+    for (i = 0 ; i < 256 ; ++i) {
+	ch = (page << 8) | i;
+	switch (wcwidth(ch)) {
+	  case 1:	classes[i] = charnarrow;			break;
+	  case 2:	classes[i] = charwide;				break;
+	  default:	classes[i] = ch < 0x20 ? charcontrol
+					       : charunprintable;	break;
+	}
+    }
+    expected = NULL;
+    if (!__atomic_compare_exchange_n(&charclasses[page], &expected, classes,
+				     0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+	free(classes);
+	classes = expected;
+    }
+    return classes;
+}
+
+/* Return how the given character is to be displayed. Values outside
+ * of Unicode, including raw bytes, are always unprintable.
+ */
+static int charclass(wchar_t ch)
+{
+    if ((unsigned long)ch >= 0x110000)
+	return charunprintable;
+    return charclasspage(ch >> 8)[ch & 0xFF];
+}
+
+/*
+ * Dump format functions.
+ */
+
+/* Store the field of the hex column for a character at p, six
+ * columns wide, and return the position following it.
+ */
+static char *puthexfield(char *p, wchar_t ch)
+{
+    if (ch < 256) {
+	memcpy(p, "    ", 4);
+	return puthex(p + 4, ch, 2, '0');
+    } else if (ch & rawbyte) {
+	memcpy(p, "   *", 4);
+	return puthex(p + 4, ch & 0xFF, 2, '0');
+    } else {
+	return puthex(p, ch, 6, ' ');
+    }
+}
+
+/* Output the glyph of a character in the text column, followed by a
+ * space unless the glyph is a wide one. The output buffer must have
+ * room for it.
+ */
+static void outputglyph(output *out, wchar_t ch)
+{
+    switch (charclass(ch)) {
+      case charwide:
+	outputchar(out, ch);
+	break;
+      case charnarrow:
+	outputchar(out, ch);
+	out->buf[out->len++] = ' ';
+	break;
+      case charcontrol:
+	outputchar(out, ctlpics + ch);
+	out->buf[out->len++] = ' ';
+	break;
+      default:
+	outputchar(out, replacechar);
+	out->buf[out->len++] = ' ';
+	break;
+    }
+}
+
+/* Return the cell of an output's cache holding the rendering of ch,
+ * filling it in if necessary, or NULL if ch cannot be cached: if it
+ * is a value outside of the six-digit range (other than a raw byte),
+ * or if its glyph does not fit.
+ */
+static rendercell const *rendercached(output *out, wchar_t ch)
+{
+    rendercell *cell;
+    mbstate_t   mbs;
+    wchar_t     glyph;
+    char        bytes[MB_LEN_MAX];
+    size_t      n;
+    int         space;
+
+    if (!out->cache)
+	return NULL;
+    cell = &out->cells[ch & (sizeof out->cells / sizeof *out->cells - 1)];
+    if (cell->ch == ch)
+	return cell;
+    if ((ch & ~0xFF) != rawbyte && (ch < 0 || ch > 0xFFFFFF))
+	return NULL;
+    space = 1;
+    switch (charclass(ch)) {
+      case charwide:	glyph = ch;	space = 0;	break;
+      case charnarrow:	glyph = ch;			break;
+      case charcontrol:	glyph = ctlpics + ch;		break;
+      default:		glyph = replacechar;		break;
+    }
+    if (out->ctx->utf8locale) {
+	n = utf8encode(bytes, glyph);
+	if (n == (size_t)-1)
+	    n = utf8encode(bytes, replacechar);
+    } else {
+	memset(&mbs, 0, sizeof mbs);
+	n = wcrtomb(bytes, glyph, &mbs);
+	if (n == (size_t)-1) {
+	    memset(&mbs, 0, sizeof mbs);
+	    n = wcrtomb(bytes, replacechar, &mbs);
+	    if (n == (size_t)-1) {
+		bytes[0] = '?';
+		n = 1;
+	    }
+	}
+    }
+    if (n + space > sizeof cell->glyph)
+	return NULL;
+    puthexfield(cell->hex, ch);
+    memcpy(cell->glyph, bytes, n);
+    if (space)
+	cell->glyph[n++] = ' ';
+    cell->len = n;
+    cell->ch = ch;
+    return cell;
+}
+
+/* Output one line of data as a hexdump, containing up to linesize
+ * characters. pos supplies the current file position, which is shown
+ * with eight hex digits, or more once it no longer fits in eight.
+ */
+static void renderdumpline(output *out, wchar_t const *buf, int count,
+			   long long pos)
+{
+    chd_context      *ctx = out->ctx;
+    rendercell const *cell;
+    long long         t;
+    char             *p;
+    int               i;
+
+    t = stattime(ctx);
+    p = outputreserve(out, 18 + 6 * ctx->linesize + 5
+			   + count * (MB_CUR_MAX + 1) + 1);
+    p = puthex(p, pos, 8, '0');
+    *p++ = ':';
+    *p++ = ' ';
+    for (i = 0 ; i < count ; ++i) {
+	cell = rendercached(out, buf[i]);
+	if (cell) {
+	    memcpy(p, cell->hex, 6);
+	    p += 6;
+	} else {
+	    p = puthexfield(p, buf[i]);
+	}
+    }
+    memset(p, ' ', 6 * (ctx->linesize - count) + 5);
+    p += 6 * (ctx->linesize - count) + 5;
+    out->len = p - out->buf;
+    for (i = 0 ; i < count ; ++i) {
+	cell = rendercached(out, buf[i]);
+	if (cell) {
+	    memcpy(out->buf + out->len, cell->glyph, cell->len);
+	    out->len += cell->len;
+	} else {
+	    outputglyph(out, buf[i]);
+	}
+    }
+    out->buf[out->len++] = '\n';
+    addstat(ctx, statlinesrendered, 1);
+    addstat(ctx, stattimeformat, stattime(ctx) - t);
+}
+
+/* Output one line of a text dump, as renderdumpline() does, unless it
+ * is identical to the previous full line, in which case it is either
+ * replaced by a line containing only an asterisk, or (if the previous
+ * line was also replaced) omitted entirely. Only full lines are
+ * compared.
+ */
+static void renderlinerun(output *out, linerun *run, wchar_t const *buf,
+			  int count, long long pos)
+{
+    int linesize = out->ctx->linesize;
+
+    if (count == linesize && run->full
+			  && !memcmp(buf, run->prev, linesize * sizeof *buf)) {
+	if (!run->skipping) {
+	    outputreserve(out, 2);
+	    out->buf[out->len++] = '*';
+	    out->buf[out->len++] = '\n';
+	    addstat(out->ctx, statlinesrendered, 1);
+	    run->skipping = 1;
+	}
+	run->pos = pos;
+	return;
+    }
+    renderdumpline(out, buf, count, pos);
+    run->full = count == linesize;
+    if (run->full)
+	memcpy(run->prev, buf, linesize * sizeof *buf);
+    run->skipping = 0;
+}
+
+/* End a run of skipped lines by rendering the last of them, so that
+ * the dump's final position (or the position reached so far, when
+ * following) is always shown.
+ */
+static void endlinerun(output *out, linerun *run)
+{
+    if (run->skipping)
+	renderdumpline(out, run->prev, out->ctx->linesize, run->pos);
+    run->skipping = 0;
+}
+
+/* Output one line of a text dump, as renderdumpline() does, if it
+ * contains a character selected by --match, or if it is within the
+ * context of a line that does. Other lines are held back, as many as
+ * the context, until a match needs them. With context, a line
+ * containing only "--" separates groups of lines that are not
+ * adjacent.
+ */
+static void filterline(output *out, linefilter *f, wchar_t const *buf,
+		       int count, long long pos)
+{
+    chd_context *ctx = out->ctx;
+    heldline    *h;
+    char        *p;
+    int          i, k;
+
+    if (!matchrun(buf, count, ctx->match, ctx->matchcount)) {
+	if (f->after) {
+	    --f->after;
+	    renderdumpline(out, buf, count, pos);
+	    f->next = pos + count;
+	} else if (ctx->context) {
+	    k = (f->oldest + f->holding) % ctx->context;
+	    if (f->holding == ctx->context)
+		f->oldest = (f->oldest + 1) % ctx->context;
+	    else
+		++f->holding;
+	    f->held[k].pos = pos;
+	    f->held[k].count = count;
+	    wmemcpy(f->chars + k * ctx->linesize, buf, count);
+	}
+	return;
+    }
+    h = f->holding ? &f->held[f->oldest] : NULL;
+    if (ctx->context && f->next >= 0 && (h ? h->pos : pos) != f->next) {
+	p = outputreserve(out, 3);
+	memcpy(p, "--\n", 3);
+	out->len += 3;
+    }
+    for (i = 0 ; i < f->holding ; ++i) {
+	k = (f->oldest + i) % ctx->context;
+	renderdumpline(out, f->chars + k * ctx->linesize, f->held[k].count,
+		       f->held[k].pos);
+    }
+    f->holding = 0;
+    f->oldest = 0;
+    renderdumpline(out, buf, count, pos);
+    f->next = pos + count;
+    f->after = ctx->context;
+}
+
+/* Write value at p as a varint: seven bits per byte, least
+ * significant first, with the high bit set on all but the last byte.
+ * The return value points just past the last byte written.
+ */
+static char *putvarint(char *p, unsigned long long value)
+{
+    while (value >= 0x80) {
+	*p++ = (char)(value | 0x80);
+	value >>= 7;
+    }
+    *p++ = (char)value;
+    return p;
+}
+
+/* Begin a binary dump whose first character is at position pos. A
+ * binary dump begins with the signature and the position as a varint,
+ * and is followed by blocks of characters.
+ */
+static void renderbinheader(output *out, long long pos)
+{
+    char *p;
+
+    p = outputreserve(out, 8 + 10);
+    memcpy(p, binmagic, 8);
+    out->len = putvarint(p + 8, pos) - out->buf;
+}
+
+/* Output count characters, at most binblocksize, as a block of a
+ * binary dump. A block begins with a varint holding twice the number
+ * of characters, plus one if any of them are raw bytes, in which case
+ * a bitmap follows with a bit set for each raw byte (lowest bit
+ * first). Then each character's value, or raw byte's value, follows
+ * as a varint.
+ */
+static void renderbinblock(output *out, wchar_t const *buf, int count)
+{
+    long long t;
+    char     *p;
+    int       raw, i;
+
+    t = stattime(out->ctx);
+    p = outputreserve(out, 3 + count / 8 + 1 + 5 * count);
+    for (raw = 0, i = 0 ; i < count && !raw ; ++i)
+	raw = buf[i] & rawbyte;
+    p = putvarint(p, 2 * count + (raw ? 1 : 0));
+    if (raw) {
+	memset(p, 0, (count + 7) / 8);
+	for (i = 0 ; i < count ; ++i)
+	    if (buf[i] & rawbyte)
+		p[i / 8] |= 1 << (i % 8);
+	p += (count + 7) / 8;
+    }
+    for (i = 0 ; i < count ; ++i) {
+	if ((unsigned long)buf[i] < 0x80)
+	    *p++ = (char)buf[i];
+	else if (buf[i] & rawbyte)
+	    p = putvarint(p, buf[i] & 0xFF);
+	else
+	    p = putvarint(p, buf[i]);
+    }
+    out->len = p - out->buf;
+    addstat(out->ctx, stattimeformat, stattime(out->ctx) - t);
+}
+
+/* End a binary dump, with a block of no characters.
+ */
+static void renderbinend(output *out)
+{
+    outputreserve(out, 1);
+    out->buf[out->len++] = '\0';
+}
+
+/* Output the characters counted in a histogram, in order, each on a
+ * line giving its hex field and glyph as in a dump, the number of
+ * times it occurs and the position of its first occurrence; and then
+ * the totals, including the number of invalid bytes that were
+ * accepted as raw bytes.
+ */
+static void renderhistogram(output *out, histogram const *h)
+{
+    charcount const *entry;
+    long long        total, distinct, raw;
+    wchar_t          ch;
+    char            *p;
+    int              page, i;
+
+    total = h->other;
+    distinct = raw = 0;
+    for (page = 0 ; page < histpages ; ++page) {
+	if (!h->pages[page])
+	    continue;
+	for (i = 0 ; i < 256 ; ++i) {
+	    entry = h->pages[page] + i;
+	    if (!entry->count)
+		continue;
+	    ch = page == histpages - 1 ? rawbyte | i : page << 8 | i;
+	    p = outputreserve(out, 6 + 2 + MB_CUR_MAX + 1 + 40);
+	    p = puthexfield(p, ch);
+	    *p++ = ' ';
+	    *p++ = ' ';
+	    out->len = p - out->buf;
+	    outputglyph(out, ch);
+	    p = out->buf + out->len;
+	    p += sprintf(p, "%14lld  ", entry->count);
+	    p = puthex(p, entry->first, 8, '0');
+	    *p++ = '\n';
+	    out->len = p - out->buf;
+	    total += entry->count;
+	    if (ch & rawbyte)
+		raw += entry->count;
+	    ++distinct;
+	}
+    }
+    p = outputreserve(out, 4 * 40);
+    p += sprintf(p, "%-20s%14lld\n", "characters", total);
+    p += sprintf(p, "%-20s%14lld\n", "distinct", distinct);
+    p += sprintf(p, "%-20s%14lld\n", "raw bytes", raw);
+    if (h->other)
+	p += sprintf(p, "%-20s%14lld\n", "beyond Unicode", h->other);
+    out->len = p - out->buf;
+}
+
+/* Output the line of column names that begins a CSV dump.
+ */
+static void rendercsvheader(output *out)
+{
+    static char const header[] = "offset,codepoint,raw,width\n";
+
+    memcpy(outputreserve(out, sizeof header - 1), header, sizeof header - 1);
+    out->len += sizeof header - 1;
+}
+
+/* Output count characters, the first of which is at position pos, as
+ * records of a JSON Lines or CSV dump, one per character: its
+ * position, its value (that of the byte, for a raw byte), whether it
+ * is a raw byte, and the number of columns it occupies in a terminal
+ * (zero for one that is unprintable, or a raw byte). Records are
+ * written straight into the output buffer, like lines of a text dump.
+ */
+static void renderrecords(output *out, wchar_t const *buf, int count,
+			  long long pos)
+{
+    chd_context *ctx = out->ctx;
+    long long    t;
+    char        *p;
+    int          json, raw, width, i;
+
+    t = stattime(ctx);
+    json = ctx->outputformat == formatjsonl;
+    p = out->buf + out->len;
+    for (i = 0 ; i < count ; ++i) {
+	if (!(i & 255)) {
+	    out->len = p - out->buf;
+	    p = outputreserve(out, recordsize * (count - i < 256 ? count - i
+								 : 256));
+	}
+	raw = (buf[i] & rawbyte) != 0;
+	switch (charclass(buf[i])) {
+	  case charwide:	width = 2;	break;
+	  case charnarrow:	width = 1;	break;
+	  default:		width = 0;	break;
+	}
+	if (json) {
+	    memcpy(p, "{\"offset\":", 10);
+	    p = putdecimal(p + 10, pos + i);
+	    memcpy(p, ",\"codepoint\":", 13);
+	    p = putdecimal(p + 13, raw ? buf[i] & 0xFF : (unsigned)buf[i]);
+	    if (raw) {
+		memcpy(p, ",\"raw\":true", 11);
+		p += 11;
+	    } else {
+		memcpy(p, ",\"raw\":false", 12);
+		p += 12;
+	    }
+	    memcpy(p, ",\"width\":", 9);
+	    p += 9;
+	    *p++ = '0' + width;
+	    *p++ = '}';
+	} else {
+	    p = putdecimal(p, pos + i);
+	    *p++ = ',';
+	    p = putdecimal(p, raw ? buf[i] & 0xFF : (unsigned)buf[i]);
+	    *p++ = ',';
+	    *p++ = '0' + raw;
+	    *p++ = ',';
+	    *p++ = '0' + width;
+	}
+	*p++ = '\n';
+    }
+    out->len = p - out->buf;
+    addstat(ctx, statlinesrendered, count);
+    addstat(ctx, stattimeformat, stattime(ctx) - t);
+}
+
+/* Render count characters, at most unitsize(), the first of which is
+ * at position pos, in the output format. If run is not NULL, runs of
+ * identical lines are collapsed.
+ */
+static void renderchars(output *out, linerun *run, wchar_t const *buf,
+			int count, long long pos)
+{
+    if (out->ctx->outputformat == formatbin)
+	renderbinblock(out, buf, count);
+    else if (out->ctx->outputformat == formatjsonl
+			|| out->ctx->outputformat == formatcsv)
+	renderrecords(out, buf, count, pos);
+    else if (run)
+	renderlinerun(out, run, buf, count, pos);
+    else
+	renderdumpline(out, buf, count, pos);
+}
+
+/* A table of the values of the hexadecimal digits, plus one, indexed
+ * by ASCII character.
+ */
+static signed char const hexvalues[128] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16
+};
+
+/* Return the value of a hexadecimal digit, or -1 if ch is not one.
+ */
+static int hexdigit(wchar_t ch)
+{
+    return (unsigned long)ch < 128 ? hexvalues[ch] - 1 : -1;
+}
+
+/* Parse the six-column field of a dump line at *pp, and advance *pp
+ * past it. A field holds a character value right-aligned in
+ * hexadecimal, or a raw byte value marked with a preceding asterisk.
+ * The end of the line counts as blank columns. The return value is
+ * the character, the byte ORed with rawbyte, -1 if the field is
+ * blank, or -2 if it is malformed.
+ */
+static long parsefield(wchar_t const **pp)
+{
+    wchar_t const *p = *pp;
+    long           value;
+    int            raw, digits, d, i;
+
+    for (i = 0 ; i < 6 && p[i] == L' ' ; ++i) ;
+    raw = i < 6 && p[i] == L'*';
+    if (raw)
+	++i;
+    value = 0;
+    for (digits = 0 ; i < 6 && (d = hexdigit(p[i])) >= 0 ; ++digits, ++i)
+	value = value * 16 + d;
+    if (i < 6 && p[i] != L'\n' && p[i] != L'\0')
+	return -2;
+    *pp = p + i;
+    if (!digits)
+	return raw ? -2 : -1;
+    if (raw)
+	return digits > 2 ? -2 : rawbyte | value;
+    return value;
+}
+
+/* Give a target its buffers, sized for the context and taken from
+ * an arena.
+ */
+static void targetalloc(dumptarget *t, chd_context const *ctx, arena *a)
+{
+    t->line = arenaalloc(a, unitsize(ctx) * sizeof *t->line);
+    t->last = arenaalloc(a, ctx->linesize * sizeof *t->last);
+    t->run.prev = arenaalloc(a, ctx->linesize * sizeof *t->run.prev);
+}
+
+/* Make a target a copy of another, keeping its own buffers.
+ */
+static void targetcopy(dumptarget *t, dumptarget const *from)
+{
+    wchar_t *line, *last, *prev;
+    int      linesize;
+
+    line = t->line;
+    last = t->last;
+    prev = t->run.prev;
+    *t = *from;
+    t->line = line;
+    t->last = last;
+    t->run.prev = prev;
+    linesize = t->out->ctx->linesize;
+    wmemcpy(t->line, from->line, t->count);
+    wmemcpy(t->last, from->last, t->lastcount);
+    if (t->run.full)
+	wmemcpy(t->run.prev, from->run.prev, linesize);
+}
+
+/* Prepare a target for characters recovered from a dump, to be
+ * output in the given format. The target's buffers are kept.
+ */
+static void targetinit(dumptarget *t, output *out, int format)
+{
+    t->out = out;
+    t->format = format;
+    t->count = 0;
+    t->pos = -1;
+    t->run.full = 0;
+    t->run.skipping = 0;
+    t->lastcount = 0;
+    t->repeating = 0;
+}
+
+/* Send n characters, the first of which is at position pos, to the
+ * target. When dumping them again, they are collected into full lines
+ * or blocks, and a break in the positions ends any partial one (and
+ * in a binary dump, starts a new dump).
+ */
+static void emitchars(dumptarget *t, wchar_t const *chars, int n,
+		      long long pos)
+{
+    linerun *run;
+    int      unit, m, i;
+
+    if (t->format == formatchars) {
+	for ( ; n > 0 ; chars += m, n -= m) {
+	    m = n < 256 ? n : 256;
+	    outputreserve(t->out, m * (MB_CUR_MAX + 1));
+	    for (i = 0 ; i < m ; ++i) {
+		if (chars[i] & rawbyte)
+		    outputbyte(t->out, chars[i] & 0xFF);
+		else
+		    outputchar(t->out, chars[i]);
+	    }
+	}
+	return;
+    }
+    run = t->out->ctx->autoskip ? &t->run : NULL;
+    if (pos != t->pos) {
+	if (t->count)
+	    renderchars(t->out, run, t->line, t->count, t->pos - t->count);
+	t->count = 0;
+	endlinerun(t->out, &t->run);
+	if (t->format == formatbin) {
+	    if (t->pos >= 0)
+		renderbinend(t->out);
+	    renderbinheader(t->out, pos);
+	} else if (t->format == formatcsv && t->pos < 0) {
+	    rendercsvheader(t->out);
+	}
+	t->pos = pos;
+    }
+    unit = unitsize(t->out->ctx);
+    for ( ; n > 0 ; chars += m, n -= m) {
+	if (!t->count && n >= unit) {
+	    m = unit;
+	    renderchars(t->out, run, chars, m, t->pos);
+	} else {
+	    m = unit - t->count < n ? unit - t->count : n;
+	    wmemcpy(t->line + t->count, chars, m);
+	    t->count += m;
+	    if (t->count == unit) {
+		renderchars(t->out, run, t->line, unit, t->pos + m - unit);
+		t->count = 0;
+	    }
+	}
+	t->pos += m;
+    }
+}
+
+/* Finish the output to the target: reset the shift state of output
+ * characters, or output the final partial line or block of a dump
+ * (and end a binary dump).
+ */
+static void emitend(dumptarget *t)
+{
+    linerun *run;
+
+    if (t->format == formatchars) {
+	outputreserve(t->out, MB_CUR_MAX + 1);
+	outputbyte(t->out, -1);
+	return;
+    }
+    run = t->out->ctx->autoskip ? &t->run : NULL;
+    if (t->count)
+	renderchars(t->out, run, t->line, t->count, t->pos - t->count);
+    endlinerun(t->out, &t->run);
+    if (t->format == formatbin) {
+	if (t->pos < 0)
+	    renderbinheader(t->out, 0);
+	renderbinend(t->out);
+    } else if (t->format == formatcsv && t->pos < 0) {
+	rendercsvheader(t->out);
+    }
+    t->count = 0;
+    t->pos = -1;
+}
+
+/* Send the characters of the last line translated to the target
+ * again, as many times as needed to reach position pos (but not more
+ * than needed to reach limit characters), following a line of a dump
+ * that replaced a run of identical lines with an asterisk. Return the
+ * number of characters output, or -1 if the lines up to pos cannot be
+ * such a run.
+ */
+static long long repeatdumpline(dumptarget *t, long long pos,
+				long long limit)
+{
+    long long from, count;
+
+    t->repeating = 0;
+    from = t->lastpos + t->lastcount;
+    if (!t->lastcount || pos < from || (pos - from) % t->lastcount)
+	return -1;
+    for (count = 0 ; from < pos && count < limit ; from += t->lastcount) {
+	emitchars(t, t->last, t->lastcount, from);
+	count += t->lastcount;
+    }
+    return count;
+}
+
+/* Parse input as a line of dumped data and send the characters
+ * represented therein to the target, preceded by any repeated lines
+ * that the previous line stood in for, up to limit characters. Return
+ * the number of characters found. If the line is malformed, the
+ * characters preceding the error are used, and *err is set to a
+ * description of the problem; otherwise it is set to NULL.
+ * (Characters that are simply being output are translated directly,
+ * without first being collected.)
+ */
+static long long translatedumpline(dumptarget *t, wchar_t const *line,
+				   long long limit, char const **err)
+{
+    wchar_t const *p;
+    long long      pos, repeated;
+    long           ch;
+    int            linesize, i, d;
+
+    *err = NULL;
+    if (line[0] == L'*' && (line[1] == L'\n' || line[1] == L'\0')) {
+	if (t->lastcount)
+	    t->repeating = 1;
+	else
+	    *err = "repeat without a preceding line";
+	return 0;
+    }
+    pos = 0;
+    for (p = line ; (d = hexdigit(*p)) >= 0 ; ++p)
+	pos = (pos << 4) | d;
+    if (p == line || p[0] != L':' || p[1] != L' ') {
+	if (!wcsncmp(line, L"==> ", 4)) {
+	    t->lastcount = 0;
+	    t->repeating = 0;
+	} else {
+	    *err = "missing address";
+	}
+	return 0;
+    }
+    p += 2;
+    repeated = 0;
+    if (t->repeating) {
+	repeated = repeatdumpline(t, pos, limit);
+	if (repeated < 0) {
+	    *err = "address does not follow repeated lines";
+	    repeated = 0;
+	}
+	if (repeated >= limit)
+	    return repeated;
+    }
+    linesize = t->out->ctx->linesize;
+    if (t->format == formatchars)
+	outputreserve(t->out, linesize * (MB_CUR_MAX + 1));
+    for (i = 0 ; i < linesize ; ++i) {
+	ch = parsefield(&p);
+	if (ch == -1)
+	    break;
+	if (ch == -2) {
+	    *err = "invalid character field";
+	    break;
+	}
+	t->last[i] = ch;
+	if (t->format != formatchars)
+	    continue;
+	if (ch & rawbyte)
+	    outputbyte(t->out, ch & 0xFF);
+	else
+	    outputchar(t->out, ch);
+    }
+    if (i && t->format != formatchars)
+	emitchars(t, t->last, i, pos);
+    t->lastcount = i;
+    t->lastpos = pos;
+    return repeated + i;
+}
+
+/* Report a malformed line of a dump file, unless the source is not
+ * being reported.
+ */
+static void dumperror(chd_context *ctx, dumpsource *src, char const *err)
+{
+    ++src->bad;
+    if (src->filename) {
+	fprintf(stderr, "%s:%lld: %s\n", src->filename, src->lineno, err);
+	ctx->exitcode = EXIT_FAILURE;
+    }
+}
+
+/* Translate one line of a dump file, or one piece of a line that did
+ * not fit in the line buffer, of length n. Pieces after the first
+ * are not parsed (no line of a valid dump is so long). The return
+ * value is the number of characters output, including those of any
+ * run of repeated lines that precedes the line (up to limit).
+ */
+static long long undumpline(dumptarget *target, wchar_t const *line, int n,
+			    long long limit, dumpsource *src)
+{
+    chd_context *ctx = target->out->ctx;
+    char const  *err;
+    long long    count, t;
+
+    count = 0;
+    if (!src->midline) {
+	++src->lineno;
+	t = stattime(ctx);
+	count = translatedumpline(target, line, limit, &err);
+	addstat(ctx, stattimeformat, stattime(ctx) - t);
+	if (err)
+	    dumperror(ctx, src, err);
+    } else if (src->midline == 1) {
+	dumperror(ctx, src, "line too long");
+    }
+    src->midline = line[n - 1] == L'\n' ? 0 : src->midline + 1;
+    return count;
+}
+
+/* Prepare to parse a binary dump file, reporting errors in the given
+ * context.
+ */
+static void binparserinit(binparser *bp, chd_context *ctx,
+			  char const *filename)
+{
+    memset(bp, 0, sizeof *bp);
+    bp->ctx = ctx;
+    bp->filename = filename;
+    bp->stage = binsignature;
+}
+
+/* Report a malformed binary dump file, and ignore the rest of it.
+ */
+static void binerror(binparser *bp, char const *err)
+{
+    fprintf(stderr, "%s: %s\n", bp->filename, err);
+    bp->ctx->exitcode = EXIT_FAILURE;
+    bp->stage = binbroken;
+}
+
+/* Parse n bytes of a binary dump file, supplied as one character per
+ * byte, and send the characters they represent to the target,
+ * stopping after limit characters. The return value is the number of
+ * characters found. Once a dump has ended, another may follow it.
+ * Malformed input is reported, and the rest of the file is ignored.
+ */
+static long long parsebin(binparser *bp, wchar_t const *p, int n,
+			  dumptarget *t, long long limit)
+{
+    wchar_t const *end;
+    wchar_t        chars[256];
+    long long      total, tm;
+    unsigned long  value;
+    int            shift, room, m, i;
+
+    tm = stattime(bp->ctx);
+    total = 0;
+    end = p + n;
+    while (p < end && total < limit) {
+	switch (bp->stage) {
+	  case binsignature:
+	    if (*p++ != (unsigned char)binmagic[bp->got]) {
+		binerror(bp, "invalid binary dump signature");
+		break;
+	    }
+	    if (++bp->got == 8) {
+		bp->stage = binstart;
+		bp->value = 0;
+		bp->shift = 0;
+	    }
+	    break;
+	  case binstart:
+	  case bincount:
+	    if (bp->shift > 63) {
+		binerror(bp, "invalid binary dump field");
+		break;
+	    }
+	    bp->value |= (unsigned long long)(*p & 0x7F) << bp->shift;
+	    bp->shift += 7;
+	    if (*p++ & 0x80)
+		break;
+	    if (bp->stage == binstart) {
+		if (bp->value > LLONG_MAX) {
+		    binerror(bp, "invalid binary dump field");
+		    break;
+		}
+		bp->pos = bp->value;
+		bp->stage = bincount;
+	    } else if (!bp->value) {
+		bp->stage = binsignature;
+		bp->got = 0;
+		break;
+	    } else if (bp->value == 1 || bp->value > 2 * binblocksize + 1) {
+		binerror(bp, "invalid binary dump block");
+		break;
+	    } else {
+		bp->count = bp->value / 2;
+		bp->hasraw = bp->value & 1;
+		bp->index = 0;
+		bp->got = 0;
+		bp->stage = bp->hasraw ? binbitmap : binvalues;
+	    }
+	    bp->value = 0;
+	    bp->shift = 0;
+	    break;
+	  case binbitmap:
+	    bp->bitmap[bp->got++] = *p++;
+	    if (bp->got == (bp->count + 7) / 8)
+		bp->stage = binvalues;
+	    break;
+	  case binvalues:
+	    value = bp->value;
+	    shift = bp->shift;
+	    room = limit - total < 256 ? limit - total : 256;
+	    for (m = 0 ; m < room && bp->index < bp->count && p < end ; ++p) {
+		value |= (unsigned long)(*p & 0x7F) << shift;
+		if (*p & 0x80) {
+		    shift += 7;
+		    if (shift > 28) {
+			binerror(bp, "invalid binary dump field");
+			break;
+		    }
+		    continue;
+		}
+		i = bp->index++;
+		if (bp->hasraw && (bp->bitmap[i / 8] & (1 << (i % 8)))) {
+		    if (value > 0xFF) {
+			binerror(bp, "invalid binary dump field");
+			break;
+		    }
+		    value |= rawbyte;
+		} else if (value > INT_MAX || (value & rawbyte)) {
+		    binerror(bp, "invalid binary dump field");
+		    break;
+		}
+		chars[m++] = value;
+		value = 0;
+		shift = 0;
+	    }
+	    bp->value = value;
+	    bp->shift = shift;
+	    if (m) {
+		addstat(bp->ctx, stattimeformat, stattime(bp->ctx) - tm);
+		emitchars(t, chars, m, bp->pos);
+		tm = stattime(bp->ctx);
+		bp->pos += m;
+		total += m;
+	    }
+	    if (bp->stage == binvalues && bp->index == bp->count)
+		bp->stage = bincount;
+	    break;
+	  default:
+	    p = end;
+	    break;
+	}
+    }
+    addstat(bp->ctx, stattimeformat, stattime(bp->ctx) - tm);
+    return total;
+}
+
+/* Finish parsing a binary dump file, reporting it if it ends partway
+ * through a dump.
+ */
+static void binparserend(binparser *bp)
+{
+    if (bp->stage != binbroken && (bp->stage != binsignature || bp->got))
+	binerror(bp, "truncated binary dump");
+}
+
+/*
+ * Worker threads.
+ */
+
+/* The body of each of the pool's threads: run jobs as they become
+ * available, until told to quit.
+ */
+static void *workerthread(void *arg)
+{
+    workpool *pool = arg;
+    int job;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+	while (!pool->quit && pool->nextjob >= pool->jobcount)
+	    pthread_cond_wait(&pool->wake, &pool->lock);
+	if (pool->quit)
+	    break;
+	job = pool->nextjob++;
+	pthread_mutex_unlock(&pool->lock);
+	pool->job(pool->data, job);
+	pthread_mutex_lock(&pool->lock);
+	if (!--pool->running)
+	    pthread_cond_signal(&pool->idle);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* Start a pool that runs jobs on the calling thread and count - 1
+ * additional threads.
+ */
+static void poolstart(workpool *pool, int count)
+{
+    int i;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    pool->jobcount = pool->nextjob = pool->running = 0;
+    pool->quit = 0;
+    pool->count = count - 1;
+    pool->threads = malloc(pool->count * sizeof *pool->threads);
+    if (pool->count && !pool->threads)
+	die("out of memory");
+    for (i = 0 ; i < pool->count ; ++i)
+	if (pthread_create(&pool->threads[i], NULL, workerthread, pool))
+	    die("unable to create worker thread");
+}
+
+/* Shut down the pool's threads.
+ */
+static void poolstop(workpool *pool)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0 ; i < pool->count ; ++i)
+	pthread_join(pool->threads[i], NULL);
+    free(pool->threads);
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+/* Call job(data, i) for each i from 0 to count - 1, spreading the
+ * calls across the pool's threads, and return when all of them have
+ * completed.
+ */
+static void poolrun(workpool *pool, void (*job)(void*, int), void *data,
+		    int count)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->data = data;
+    pool->jobcount = count;
+    pool->nextjob = 0;
+    pool->running = count;
+    pthread_cond_broadcast(&pool->wake);
+    while (pool->nextjob < pool->jobcount) {
+	i = pool->nextjob++;
+	pthread_mutex_unlock(&pool->lock);
+	job(data, i);
+	pthread_mutex_lock(&pool->lock);
+	--pool->running;
+    }
+    while (pool->running)
+	pthread_cond_wait(&pool->idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Character counts.
+ */
+
+/* Return the entry of a histogram for ch, allocating its page if
+ * necessary, or NULL if ch is beyond Unicode.
+ */
+static charcount *histentry(histogram *h, wchar_t ch)
+{
+    int page;
+
+    if ((ch & ~0xFF) == rawbyte)
+	page = histpages - 1;
+    else if (ch >= 0 && ch < 0x110000)
+	page = ch >> 8;
+    else
+	return NULL;
+    if (!h->pages[page]) {
+	h->pages[page] = calloc(256, sizeof **h->pages);
+	if (!h->pages[page])
+	    die("out of memory");
+    }
+    return h->pages[page] + (ch & 0xFF);
+}
+
+/* Count the n characters at buf, the first of which is at position
+ * pos.
+ */
+static void countchars(histogram *h, wchar_t const *buf, int n, long long pos)
+{
+    charcount *entry;
+    int        i;
+
+    for (i = 0 ; i < n ; ++i) {
+	if ((unsigned long)buf[i] < 0x110000 && h->pages[buf[i] >> 8])
+	    entry = h->pages[buf[i] >> 8] + (buf[i] & 0xFF);
+	else
+	    entry = histentry(h, buf[i]);
+	if (!entry) {
+	    ++h->other;
+	    continue;
+	}
+	if (!entry->count++)
+	    entry->first = pos + i;
+    }
+}
+
+/* Add the counts of the histogram from, whose positions are relative
+ * to pos, to the histogram h, and then reset from to be empty.
+ */
+static void mergehistogram(histogram *h, histogram *from, long long pos)
+{
+    charcount *entry, *src;
+    int        page, i;
+
+    for (page = 0 ; page < histpages ; ++page) {
+	src = from->pages[page];
+	if (!src)
+	    continue;
+	for (i = 0 ; i < 256 ; ++i) {
+	    if (!src[i].count)
+		continue;
+	    entry = histentry(h, page == histpages - 1 ? rawbyte | i
+						         : page << 8 | i);
+	    if (!entry->count)
+		entry->first = pos + src[i].first;
+	    entry->count += src[i].count;
+	}
+	memset(src, 0, 256 * sizeof *src);
+    }
+    h->other += from->other;
+    from->other = 0;
+}
+
+/* Free the pages of a histogram.
+ */
+static void freehistogram(histogram *h)
+{
+    int page;
+
+    for (page = 0 ; page < histpages ; ++page)
+	free(h->pages[page]);
+}
+
+/*
+ * Parallel dumping.
+ */
+
+/* Return true if the rest of the input can be dumped in parallel: the
+ * current file must be the last one, it must be memory-mapped, and
+ * its encoding must be one in which character boundaries can be found
+ * from an arbitrary position. (Nor can a job of the worker threads
+ * divide its own work further.)
+ */
+static int canparallel(state *s)
+{
+    return s->ctx->jobs > 1 && !s->injob
+			    && inputinit(s) && s->map && !s->inputerr
+			    && !s->filenames[1] && s->codec != codeciconv
+			    && (s->codec != codecmbs || MB_CUR_MAX == 1);
+}
+
+/* Return the offset of the first character boundary in the mapped
+ * file at or after pos. In UTF-8, any byte that is not a continuation
+ * byte begins a character, whatever precedes it. In UTF-16 and UTF-32,
+ * any code unit does, except for the second half of a surrogate pair.
+ */
+static off_t syncpos(state *s, off_t pos)
+{
+    unsigned char const *p;
+    int unit;
+
+    if (s->codec == codecutf8)
+	while (pos < s->mapsize && (s->map[pos] & 0xC0) == 0x80)
+	    ++pos;
+    unit = codecunit(s->codec);
+    if (unit > 1 && pos % unit)
+	pos += unit - pos % unit;
+    if (unit == 2 && pos + 2 <= s->mapsize) {
+	p = (unsigned char const*)s->map + pos;
+	if (((s->codec == codecutf16be ? p[0] : p[1]) & 0xFC) == 0xDC)
+	    pos += 2;
+    }
+    return pos < s->mapsize ? pos : s->mapsize;
+}
+
+/* Decode one chunk of the mapped file of a parallel dump.
+ */
+static void decodechunk(paralleldump const *pd, dumpchunk *chunk)
+{
+    chd_context *ctx = pd->ctx;
+    state        dec;
+
+    if (chunk->size > chunk->alloced) {
+	free(chunk->chars);
+	chunk->alloced = chunk->size;
+	chunk->chars = malloc(chunk->alloced * sizeof *chunk->chars);
+	if (!chunk->chars)
+	    die("out of memory");
+    }
+    memset(&dec, 0, sizeof dec);
+    dec.ctx = ctx;
+    dec.codec = pd->codec;
+    dec.iconv = (iconv_t)-1;
+    dec.chars = chunk->chars;
+    decodeinput(&dec, chunk->src, chunk->size, 1);
+    addstat(ctx, statbytesread, chunk->size);
+    chunk->count = dec.charcount;
+    chunk->err = dec.inputerr;
+}
+
+/* Decode one chunk of a parallel dump's round. (Run by a worker
+ * thread.)
+ */
+static void decodechunkjob(void *data, int i)
+{
+    paralleldump *pd = data;
+
+    decodechunk(pd, &pd->chunks[i + 1]);
+}
+
+/* Copy n characters from the round's chunks, starting at the given
+ * offset from the beginning of the first chunk, into buf.
+ */
+static void gatherchars(paralleldump *pd, int offset, int n, wchar_t *buf)
+{
+    int c, len, m;
+
+    if (!n)
+	return;
+    for (c = 0 ; offset >= pd->chunks[c].start + pd->chunks[c].count ; ++c) ;
+    offset -= pd->chunks[c].start;
+    for (m = 0 ; m < n ; m += len, offset = 0, ++c) {
+	len = pd->chunks[c].count - offset;
+	if (len > n - m)
+	    len = n - m;
+	wmemmove(buf + m, pd->chunks[c].chars + offset, len);
+    }
+}
+
+/* Render a range of the round's dump lines (or blocks) into one of
+ * the output buffers. A line's characters are rendered in place unless
+ * they are split across chunks. (Run by a worker thread.)
+ */
+static void renderchunkjob(void *data, int i)
+{
+    paralleldump *pd = data;
+    wchar_t      *buf = pd->lines + i * pd->unit;
+    int           line, last, offset, c, n;
+
+    line = i * pd->linesperjob;
+    last = line + pd->linesperjob < pd->linecount ?
+			line + pd->linesperjob : pd->linecount;
+    for (c = 0 ; line < last ; ++line) {
+	offset = line * pd->unit;
+	n = pd->total - offset < pd->unit ? pd->total - offset : pd->unit;
+	while (offset >= pd->chunks[c].start + pd->chunks[c].count)
+	    ++c;
+	if (offset + n <= pd->chunks[c].start + pd->chunks[c].count) {
+	    renderchars(&pd->outs[i], NULL,
+			pd->chunks[c].chars + offset - pd->chunks[c].start,
+			n, pd->pos + offset);
+	} else {
+	    gatherchars(pd, offset, n, buf);
+	    renderchars(&pd->outs[i], NULL, buf, n, pd->pos + offset);
+	}
+    }
+}
+
+/* Dump the remainder of the current file using the worker threads,
+ * starting at character position pos, and return the position
+ * reached. The file is processed in rounds: each job decodes one
+ * chunk of the file, and then the complete dump lines are divided
+ * evenly among the jobs for rendering, and the rendered lines are
+ * output in order. Left-over characters that do not fill a line are
+ * carried over to the start of the next round. The output is
+ * identical to what dump() produces by itself.
+ */
+static long long dumpparallel(state *s, output *out, long long pos)
+{
+    chd_context *ctx = s->ctx;
+    paralleldump pd;
+    workpool     pool;
+    off_t        from, to;
+    long long    errend;
+    int          final, n, i;
+
+    pd.ctx = ctx;
+    pd.codec = s->codec;
+    pd.unit = unitsize(ctx);
+    while (s->maxinputlen >= pd.unit && s->charcount - s->charpos >= pd.unit) {
+	renderchars(out, NULL, s->chars + s->charpos, pd.unit, pos);
+	s->charpos += pd.unit;
+	s->maxinputlen -= pd.unit;
+	pos += pd.unit;
+    }
+    outputflush(out);
+
+    poolstart(&pool, ctx->jobs);
+    pd.chunks = calloc(ctx->jobs + 1, sizeof *pd.chunks);
+    pd.outs = malloc(ctx->jobs * sizeof *pd.outs);
+    if (!pd.chunks || !pd.outs)
+	die("out of memory");
+    arenainit(&pd.buffers, arenaspan(ctx->jobs * pd.unit * sizeof *pd.lines));
+    pd.lines = arenaalloc(&pd.buffers, ctx->jobs * pd.unit * sizeof *pd.lines);
+    for (i = 0 ; i < ctx->jobs ; ++i) {
+	outputalloc(&pd.outs[i], ctx);
+	pd.outs[i].grow = 1;
+    }
+    n = s->charcount - s->charpos;
+    pd.chunks[0].alloced = n > pd.unit ? n : pd.unit;
+    pd.chunks[0].chars = malloc(pd.chunks[0].alloced * sizeof(wchar_t));
+    if (!pd.chunks[0].chars)
+	die("out of memory");
+    wmemcpy(pd.chunks[0].chars, s->chars + s->charpos, n);
+    pd.chunks[0].count = n;
+    s->charpos = s->charcount;
+
+    from = s->readpos;
+    errend = -1;
+    for (final = 0 ; !final ; ) {
+	for (i = 1 ; i <= ctx->jobs ; ++i) {
+	    to = s->mapsize - from < chunksize ? s->mapsize : from + chunksize;
+	    to = syncpos(s, to);
+	    pd.chunks[i].src = s->map + from;
+	    pd.chunks[i].size = to - from;
+	    from = to;
+	}
+	poolrun(&pool, decodechunkjob, &pd, ctx->jobs);
+
+	pd.total = 0;
+	for (i = 0 ; i <= ctx->jobs ; ++i) {
+	    pd.chunks[i].start = pd.total;
+	    pd.total += pd.chunks[i].count;
+	    if (pd.chunks[i].err) {
+		errend = pd.total;
+		for (++i ; i <= ctx->jobs ; ++i) {
+		    pd.chunks[i].start = pd.total;
+		    pd.chunks[i].count = 0;
+		}
+		final = 1;
+	    }
+	}
+	if (from >= s->mapsize)
+	    final = 1;
+	if (pd.total >= s->maxinputlen) {
+	    if (errend >= s->maxinputlen)
+		errend = -1;
+	    pd.total = s->maxinputlen;
+	    final = 1;
+	}
+	pd.linecount = final ? (pd.total + pd.unit - 1) / pd.unit
+			     : pd.total / pd.unit;
+	pd.linesperjob = (pd.linecount + ctx->jobs - 1) / ctx->jobs;
+	pd.pos = pos;
+	poolrun(&pool, renderchunkjob, &pd, ctx->jobs);
+	for (i = 0 ; i < ctx->jobs ; ++i)
+	    outputflush(&pd.outs[i]);
+
+	n = final ? pd.total : pd.linecount * pd.unit;
+	pos += n;
+	s->maxinputlen -= n;
+	gatherchars(&pd, n, pd.total - n, pd.chunks[0].chars);
+	pd.chunks[0].count = pd.total - n;
+    }
+
+    for (i = 0 ; i <= ctx->jobs ; ++i)
+	free(pd.chunks[i].chars);
+    for (i = 0 ; i < ctx->jobs ; ++i)
+	free(pd.outs[i].buf);
+    free(pd.chunks);
+    free(pd.outs);
+    arenafree(&pd.buffers);
+    poolstop(&pool);
+
+    s->readpos = s->mapsize;
+    s->inputerr = errend >= 0 ? EILSEQ : 0;
+    inputupdate(s);
+    return pos;
+}
+
+/* Count the characters of one chunk of a parallel scan's round. (Run
+ * by a worker thread.)
+ */
+static void countchunkjob(void *data, int i)
+{
+    paralleldump *pd = data;
+
+    countchars(&pd->counts[i], pd->chunks[i + 1].chars,
+	       pd->chunks[i + 1].count, 0);
+}
+
+/* Count the rest of the input's characters in parallel, as scan()
+ * does, with the same requirements as dumpparallel(). In each round,
+ * the worker threads decode a chunk each, and then count its
+ * characters into a histogram of their own, which is merged into h in
+ * order. The file is closed afterwards, and the return value is the
+ * position following the last character counted.
+ */
+static long long scanparallel(state *s, histogram *h, long long pos)
+{
+    chd_context *ctx = s->ctx;
+    paralleldump pd;
+    workpool     pool;
+    off_t        from, to;
+    int          final, err, n, i;
+
+    n = s->charcount - s->charpos;
+    if (n > s->maxinputlen)
+	n = s->maxinputlen;
+    countchars(h, s->chars + s->charpos, n, pos);
+    s->charpos = s->charcount;
+    s->maxinputlen -= n;
+    pos += n;
+
+    pd.ctx = ctx;
+    pd.codec = s->codec;
+    poolstart(&pool, ctx->jobs);
+    pd.chunks = calloc(ctx->jobs + 1, sizeof *pd.chunks);
+    pd.counts = calloc(ctx->jobs, sizeof *pd.counts);
+    if (!pd.chunks || !pd.counts)
+	die("out of memory");
+
+    from = s->readpos;
+    err = 0;
+    for (final = s->maxinputlen <= 0 ; !final ; ) {
+	for (i = 1 ; i <= ctx->jobs ; ++i) {
+	    to = s->mapsize - from < chunksize ? s->mapsize : from + chunksize;
+	    to = syncpos(s, to);
+	    pd.chunks[i].src = s->map + from;
+	    pd.chunks[i].size = to - from;
+	    from = to;
+	}
+	poolrun(&pool, decodechunkjob, &pd, ctx->jobs);
+	for (i = 1 ; i <= ctx->jobs ; ++i) {
+	    if (final) {
+		pd.chunks[i].count = 0;
+	    } else if (pd.chunks[i].count >= s->maxinputlen) {
+		pd.chunks[i].count = s->maxinputlen;
+		final = 1;
+	    } else if (pd.chunks[i].err) {
+		err = 1;
+		final = 1;
+	    }
+	    s->maxinputlen -= pd.chunks[i].count;
+	}
+	if (from >= s->mapsize)
+	    final = 1;
+	poolrun(&pool, countchunkjob, &pd, ctx->jobs);
+	for (i = 0 ; i < ctx->jobs ; ++i) {
+	    mergehistogram(h, &pd.counts[i], pos);
+	    pos += pd.chunks[i + 1].count;
+	}
+    }
+
+    for (i = 0 ; i <= ctx->jobs ; ++i)
+	free(pd.chunks[i].chars);
+    for (i = 0 ; i < ctx->jobs ; ++i)
+	freehistogram(&pd.counts[i]);
+    free(pd.chunks);
+    free(pd.counts);
+    poolstop(&pool);
+
+    s->readpos = s->mapsize;
+    s->inputerr = err ? EILSEQ : 0;
+    inputupdate(s);
+    return pos;
+}
+
+/* Return the offset just past the first newline in the mapped file
+ * at or after pos - 1, or the end of the file if there is none.
+ */
+static off_t nextlinepos(state *s, off_t pos)
+{
+    char const *nl;
+
+    if (pos >= s->mapsize)
+	return s->mapsize;
+    nl = memchr(s->map + pos - 1, '\n', s->mapsize - pos + 1);
+    return nl ? nl + 1 - s->map : s->mapsize;
+}
+
+/* Translate the dump lines in a decoded chunk of a dump file, until
+ * the chunk is exhausted or limit characters have been output. Lines
+ * are split up exactly as nextwline() does. The return value is the
+ * number of characters output.
+ */
+static long long undumpchunk(dumpchunk const *chunk, dumptarget *target,
+			     wchar_t *line, int len, long long limit,
+			     dumpsource *src)
+{
+    wchar_t const *p, *end, *nl;
+    long long      count;
+    int            n;
+
+    count = 0;
+    p = chunk->chars;
+    end = chunk->chars + chunk->count;
+    while (p < end && count < limit) {
+	n = end - p < len - 1 ? end - p : len - 1;
+	nl = wmemchr(p, L'\n', n);
+	if (nl)
+	    n = nl - p + 1;
+	wmemcpy(line, p, n);
+	line[n] = L'\0';
+	count += undumpline(target, line, n, limit - count, src);
+	p += n;
+    }
+    return count;
+}
+
+/* Decode and translate one chunk of a dump file. (Run by a worker
+ * thread.)
+ */
+static void undumpchunkjob(void *data, int i)
+{
+    paralleldump *pd = data;
+    dumpsource    src = { NULL, 0, 0, 0 };
+    wchar_t      *line = pd->lines + i * pd->linelen;
+
+    decodechunk(pd, &pd->chunks[i]);
+    targetinit(&pd->targets[i], &pd->outs[i], formatchars);
+    pd->chunks[i].outcount = undumpchunk(&pd->chunks[i], &pd->targets[i],
+					 line, pd->linelen, LLONG_MAX, &src);
+    pd->chunks[i].lines = src.lineno;
+    pd->chunks[i].bad = src.bad;
+}
+
+/* Translate the whole of the current file, which must not have been
+ * read from yet, using the worker threads. The file is split into
+ * chunks at line boundaries, and each job decodes its chunk and
+ * translates it into its own output buffer. The buffers are then
+ * output in order. The one chunk in which --limit is reached is
+ * translated again, this time stopping at the limit, as is any chunk
+ * containing malformed lines, so that they can be reported in order.
+ * So is a chunk that begins within a run of repeated lines, which
+ * needs the last line of the chunk before it. Since lines are found
+ * by searching for newline bytes, the file must not be in UTF-16 or
+ * UTF-32.
+ */
+static void undumpparallel(state *s, output *out, wchar_t *line, int len)
+{
+    chd_context *ctx = s->ctx;
+    paralleldump pd;
+    workpool     pool;
+    dumpsource   src, redo;
+    dumptarget   carry, retarget;
+    off_t        from, to;
+    int          final, err, i;
+
+    outputflush(out);
+    pd.ctx = ctx;
+    pd.codec = s->codec;
+    poolstart(&pool, ctx->jobs);
+    pd.chunks = calloc(ctx->jobs, sizeof *pd.chunks);
+    pd.outs = malloc(ctx->jobs * sizeof *pd.outs);
+    pd.targets = malloc(ctx->jobs * sizeof *pd.targets);
+    if (!pd.chunks || !pd.outs || !pd.targets)
+	die("out of memory");
+    pd.linelen = len;
+    arenainit(&pd.buffers, arenaspan(ctx->jobs * len * sizeof *pd.lines)
+			   + (ctx->jobs + 2) * targetspan(ctx));
+    pd.lines = arenaalloc(&pd.buffers, ctx->jobs * len * sizeof *pd.lines);
+    for (i = 0 ; i < ctx->jobs ; ++i) {
+	outputalloc(&pd.outs[i], ctx);
+	pd.outs[i].grow = 1;
+	targetalloc(&pd.targets[i], ctx, &pd.buffers);
+    }
+    targetalloc(&carry, ctx, &pd.buffers);
+    targetalloc(&retarget, ctx, &pd.buffers);
+
+    src.filename = *s->filenames;
+    src.lineno = 0;
+    src.midline = 0;
+    src.bad = 0;
+    targetinit(&carry, out, formatchars);
+    from = 0;
+    err = 0;
+    for (final = s->maxinputlen <= 0 ; !final ; ) {
+	for (i = 0 ; i < ctx->jobs ; ++i) {
+	    to = s->mapsize - from < chunksize ? s->mapsize : from + chunksize;
+	    to = nextlinepos(s, to);
+	    pd.chunks[i].src = s->map + from;
+	    pd.chunks[i].size = to - from;
+	    from = to;
+	}
+	poolrun(&pool, undumpchunkjob, &pd, ctx->jobs);
+	for (i = 0 ; i < ctx->jobs && !final ; ++i) {
+	    if (pd.chunks[i].outcount < s->maxinputlen && !pd.chunks[i].bad
+						       && !carry.repeating) {
+		s->maxinputlen -= pd.chunks[i].outcount;
+		addstat(ctx, statlinesparsed, pd.chunks[i].lines);
+		targetcopy(&carry, &pd.targets[i]);
+	    } else {
+		pd.outs[i].len = 0;
+		redo = src;
+		targetcopy(&retarget, &carry);
+		retarget.out = &pd.outs[i];
+		s->maxinputlen -= undumpchunk(&pd.chunks[i], &retarget,
+					      line, len, s->maxinputlen, &redo);
+		addstat(ctx, statlinesparsed, redo.lineno - src.lineno);
+		targetcopy(&carry, &retarget);
+		if (s->maxinputlen <= 0)
+		    final = 1;
+	    }
+	    src.lineno += pd.chunks[i].lines;
+	    if (!final)
+		err = pd.chunks[i].err;
+	    outputflush(&pd.outs[i]);
+	    if (err)
+		final = 1;
+	}
+	if (from >= s->mapsize)
+	    final = 1;
+    }
+
+    for (i = 0 ; i < ctx->jobs ; ++i) {
+	free(pd.chunks[i].chars);
+	free(pd.outs[i].buf);
+    }
+    free(pd.chunks);
+    free(pd.outs);
+    free(pd.targets);
+    arenafree(&pd.buffers);
+    poolstop(&pool);
+
+    s->charpos = s->charcount = 0;
+    s->inputerr = err ? EILSEQ : 0;
+    inputupdate(s);
+}
+
+/*
+ * Byte-range extraction.
+ */
+
+/* Find the bytes making up the first count characters of the len
+ * bytes at src, as measurechars() does, for input decoded by iconv.
+ * The characters are converted a buffer at a time and discarded.
+ */
+static int measureiconv(state *s, char const *src, int len, int atend,
+			long long count, long long *pcount)
+{
+    wchar_t     buf[256];
+    char       *in, *out;
+    size_t      inleft, outleft;
+    long long   done;
+    int         i;
+
+    done = 0;
+    i = 0;
+    while (done < count && i < len) {
+	in = (char*)src + i;
+	inleft = len - i;
+	out = (char*)buf;
+	outleft = (count - done < 256 ? count - done : 256) * sizeof *buf;
+	if (iconv(s->iconv, &in, &inleft, &out, &outleft) != (size_t)-1) {
+	    done += (wchar_t*)out - buf;
+	    i = in - src;
+	    break;
+	}
+	done += (wchar_t*)out - buf;
+	if (errno == E2BIG && in > src + i) {
+	    i = in - src;
+	    continue;
+	}
+	i = in - src;
+	if (errno == E2BIG || (errno == EINVAL && !atend))
+	    break;
+	if (!s->ctx->acceptbadchars) {
+	    s->inputerr = EILSEQ;
+	    break;
+	}
+	iconv(s->iconv, NULL, NULL, NULL, NULL);
+	++done;
+	++i;
+    }
+    *pcount = done;
+    return i;
+}
+
+/* Find the bytes making up the first count characters of the len
+ * bytes at src, as measurechars() does, for input in UTF-16 or UTF-32.
+ * An invalid unit is taken whole, even when fewer of its raw bytes are
+ * needed, so as to stay aligned.
+ */
+static int measurewide(state *s, char const *src, int len, int atend,
+			long long count, long long *pcount)
+{
+    unsigned char const *p, *end;
+    unsigned int u, v;
+    long long   done;
+    int         unit, big, valid, n;
+
+    unit = codecunit(s->codec);
+    big = s->codec == codecutf16be || s->codec == codecutf32be;
+    p = (unsigned char const*)src;
+    end = p + len;
+    for (done = 0 ; done < count && end - p >= unit ; p += n) {
+	n = unit;
+	if (unit == 2) {
+	    u = big ? p[0] << 8 | p[1] : p[1] << 8 | p[0];
+	    if ((u & 0xFC00) == 0xD800) {
+		if (end - p < 4 && !atend)
+		    break;
+		v = 0;
+		if (end - p >= 4)
+		    v = big ? p[2] << 8 | p[3] : p[3] << 8 | p[2];
+		if ((v & 0xFC00) == 0xDC00)
+		    n = 4;
+	    }
+	    valid = n == 4 || (u & 0xF800) != 0xD800;
+	} else {
+	    u = big ? (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]
+		    : (unsigned int)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0];
+	    valid = u <= 0x10FFFF && (u & 0xFFFFF800) != 0xD800;
+	}
+	if (valid) {
+	    ++done;
+	    continue;
+	}
+	if (!s->ctx->acceptbadchars) {
+	    s->inputerr = EILSEQ;
+	    break;
+	}
+	done = count - done > unit ? done + unit : count;
+    }
+    if (done < count && p < end && end - p < unit && atend
+		     && !s->inputerr) {
+	if (!s->ctx->acceptbadchars) {
+	    s->inputerr = EILSEQ;
+	} else {
+	    n = end - p < count - done ? end - p : count - done;
+	    done += n;
+	    p += n;
+	}
+    }
+    *pcount = done;
+    return p - (unsigned char const*)src;
+}
+
+/* Find the bytes making up the first count characters of the len
+ * bytes at src, decoding them as decodeinput() would, and return the
+ * number of bytes. The number of characters found is stored in
+ * pcount, and is less than count only if the input runs out or an
+ * invalid sequence is encountered (in which case the error is
+ * recorded, unless acceptbadchars is true).
+ */
+static int measurechars(state *s, char const *src, int len, int atend,
+			long long count, long long *pcount)
+{
+    unsigned char const *p, *end;
+    mbstate_t   saved;
+    long long   done;
+    wchar_t     wc;
+    size_t      n;
+
+    if (s->codec == codeciconv)
+	return measureiconv(s, src, len, atend, count, pcount);
+    if (codecunit(s->codec) > 1)
+	return measurewide(s, src, len, atend, count, pcount);
+    p = (unsigned char const*)src;
+    end = p + len;
+    for (done = 0 ; done < count && p < end ; ++done, p += n) {
+	if (s->codec != codecmbs && *p < 0x80) {
+	    n = 1;
+	    continue;
+	}
+	if (s->codec == codectable) {
+	    n = s->ctx->table[*p - 0x80] ? 1 : (size_t)-1;
+	} else if (s->codec == codecutf8) {
+	    n = utf8decode(p, end - p, &wc);
+	    if (n == 0)
+		n = (size_t)-2;
+	} else {
+	    saved = s->mbs;
+	    n = mbrtowc(&wc, (char const*)p, end - p, &s->mbs);
+	    if (n == (size_t)-2 && !atend)
+		s->mbs = saved;
+	}
+	if (n == (size_t)-2 && !atend)
+	    break;
+	if (n == (size_t)-1 || n == (size_t)-2) {
+	    if (!s->ctx->acceptbadchars) {
+		s->inputerr = EILSEQ;
+		break;
+	    }
+	    memset(&s->mbs, 0, sizeof s->mbs);
+	    n = 1;
+	} else if (n == 0) {
+	    n = 1;
+	}
+    }
+    *pcount = done;
+    return p - (unsigned char const*)src;
+}
+
+/* Find the next count characters of the current file, starting at
+ * the byte offset in ppos, and advance ppos past them. A regular file
+ * is examined in place, and the characters are not copied. Any other
+ * file is read sequentially, with incomplete sequences kept in the
+ * byte buffer, and if copy is true the bytes read are written to
+ * standard output. The return value is the number of characters
+ * found, which is less than count only if the file runs out.
+ */
+static long long scanchars(state *s, int seekable, off_t *ppos,
+			   long long count, int copy)
+{
+    char const *src;
+    long long   done, m;
+    int         len, n, atend, more;
+
+    more = !s->bytecount;
+    for (done = 0 ; done < count && !s->inputerr ; done += m, more = 1) {
+	if (s->map) {
+	    len = s->mapsize - *ppos < inbufsize ? s->mapsize - *ppos
+						 : inbufsize;
+	    src = s->map + *ppos;
+	    atend = *ppos + len == s->mapsize;
+	} else {
+	    n = 0;
+	    if (seekable || more) {
+		do
+		    n = seekable ? pread(s->currentfd, s->bytes, inbufsize,
+					 *ppos)
+				 : read(s->currentfd, s->bytes + s->bytecount,
+					inbufsize - s->bytecount);
+		while (n < 0 && errno == EINTR);
+		if (n < 0) {
+		    s->inputerr = errno;
+		    break;
+		}
+	    }
+	    len = seekable ? n : s->bytecount + n;
+	    src = s->bytes;
+	    atend = seekable ? len < inbufsize : more && n == 0;
+	    addstat(s->ctx, statbytesread, n);
+	}
+	if (!len)
+	    break;
+	n = measurechars(s, src, len, atend, count - done, &m);
+	if (copy && n) {
+	    writeoutput(s->ctx, src, n);
+	    addstat(s->ctx, statbyteswritten, n);
+	}
+	*ppos += n;
+	if (!seekable && !s->map) {
+	    s->bytecount = len - n;
+	    memmove(s->bytes, s->bytes + n, s->bytecount);
+	}
+	if (!n && atend)
+	    break;
+    }
+    return done;
+}
+
+/* Copy the bytes of the current file from offset from up to offset
+ * to onto the output. Where the system allows it, and the output is
+ * standard output, the data is moved by the kernel with
+ * copy_file_range(), sendfile() or splice(), without passing through
+ * user memory; otherwise the bytes are read and written in blocks.
+ */
+static void copyrange(state *s, off_t from, off_t to)
+{
+    off_t pos;
+    long  n;
+
+    flushoutput(s->ctx);
+    addstat(s->ctx, statbyteswritten, to - from);
+    pos = from;
+#ifdef __linux__
+    if (!s->ctx->writer) {
+	while (pos < to
+	       && (n = copy_file_range(s->currentfd, &pos, STDOUT_FILENO, NULL,
+				       to - pos, 0)) > 0) ;
+	while (pos < to
+	       && (n = sendfile(STDOUT_FILENO, s->currentfd, &pos,
+				to - pos)) > 0) ;
+	while (pos < to
+	       && (n = splice(s->currentfd, &pos, STDOUT_FILENO, NULL,
+			      to - pos, SPLICE_F_MOVE)) > 0) ;
+    }
+#endif
+    while (pos < to) {
+	n = pread(s->currentfd, s->bytes, to - pos < inbufsize ? to - pos
+							     : inbufsize, pos);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0) {
+	    s->inputerr = n ? errno : EIO;
+	    break;
+	}
+	if (!writeoutput(s->ctx, s->bytes, n))
+	    break;
+	pos += n;
+    }
+    flushoutput(s->ctx);
+}
+
+/*
+ * The operations.
+ */
+
+/* Output hexdump lines from the given filenames to the output buffer
+ * until there's no more input, or output the characters as a binary
+ * dump. Collapsing runs of lines, and selecting them with --match,
+ * depend on the preceding lines, so they are always done by a single
+ * thread, as is a dump limited to less than a chunk of input.
+ */
+static void dumpinput(state *s, output *out)
+{
+    chd_context   *ctx = s->ctx;
+    linerun        run;
+    linefilter     filter;
+    wchar_t const *line;
+    wchar_t       *buf;
+    long long      pos;
+    size_t         mark;
+    int            unit, count, n;
+
+    if (ctx->outputformat == formatbin)
+	renderbinheader(out, s->startoffset);
+    else if (ctx->outputformat == formatcsv)
+	rendercsvheader(out);
+    if (skipinput(s, s->startoffset) < s->startoffset) {
+	if (ctx->outputformat == formatbin)
+	    renderbinend(out);
+	return;
+    }
+    pos = s->startoffset;
+    unit = unitsize(ctx);
+    mark = s->lines.used;
+    buf = arenaalloc(&s->lines, unit * sizeof *buf);
+    run.prev = arenaalloc(&s->lines, ctx->linesize * sizeof *run.prev);
+    run.full = 0;
+    run.skipping = 0;
+    filter.chars = arenaalloc(&s->lines, (size_t)ctx->context * ctx->linesize
+					 * sizeof *filter.chars);
+    filter.held = arenaalloc(&s->lines, ctx->context * sizeof *filter.held);
+    filter.holding = 0;
+    filter.oldest = 0;
+    filter.after = 0;
+    filter.next = -1;
+
+    if (!ctx->autoskip && !ctx->matchcount && s->maxinputlen >= chunksize
+		       && canparallel(s))
+	pos = dumpparallel(s, out, pos);
+    s->waitms = ctx->latency;
+    while (s->maxinputlen > 0) {
+	count = unit < s->maxinputlen ? unit : s->maxinputlen;
+	line = nextdumpline(s, buf, count, &n);
+	if (n && ctx->matchcount)
+	    filterline(out, &filter, line, n, pos);
+	else if (n)
+	    renderchars(out, ctx->autoskip ? &run : NULL, line, n, pos);
+	if (n < count) {
+	    if (!s->stalled)
+		break;
+	    endlinerun(out, &run);
+	    outputflush(out);
+	    flushoutput(ctx);
+	    if (!n)
+		s->waitms = -1;
+	}
+	pos += n;
+	s->maxinputlen -= n;
+    }
+    endlinerun(out, &run);
+    if (ctx->outputformat == formatbin)
+	renderbinend(out);
+    s->lines.used = mark;
+}
+
+/* Display hexdump lines from the given filenames until there's no
+ * more input.
+ */
+static void dump(state *s)
+{
+    output out;
+
+    outputalloc(&out, s->ctx);
+    dumpinput(s, &out);
+    outputflush(&out);
+    free(out.buf);
+}
+
+/* Dump the one file named in the state on its own, under a header
+ * giving its name. Nothing is output if the file cannot be opened.
+ */
+static void dumpfile(state *s, output *out)
+{
+    char *p;
+    int   len;
+
+    if (!inputinit(s))
+	return;
+    if (s->ctx->outputformat == formattext) {
+	len = strlen(*s->filenames);
+	p = outputreserve(out, len + 9);
+	memcpy(p, "==> ", 4);
+	memcpy(p + 4, *s->filenames, len);
+	memcpy(p + 4 + len, " <==\n", 5);
+	out->len += len + 9;
+    }
+    dumpinput(s, out);
+}
+
+/* Dump the named file on its own, directly to the output.
+ */
+static void dumpalone(state const *s, char *filename)
+{
+    output out;
+    state  one;
+    char  *onefile[2];
+
+    one = *s;
+    onefile[0] = filename;
+    onefile[1] = NULL;
+    one.filenames = onefile;
+    outputalloc(&out, s->ctx);
+    dumpfile(&one, &out);
+    outputflush(&out);
+    free(out.buf);
+}
+
+/* Dump one file of a batch into its own output buffer, noting whether
+ * it failed instead of reporting it. (Run by a worker thread.)
+ */
+static void separatejob(void *data, int i)
+{
+    separatebatch *batch = data;
+    state          s;
+    char          *onefile[2];
+
+    s = *batch->settings;
+    onefile[0] = batch->filenames[i];
+    onefile[1] = NULL;
+    s.filenames = onefile;
+    s.injob = 1;
+    s.failed = 0;
+    inputalloc(&s);
+    outputalloc(&batch->outs[i], s.ctx);
+    batch->outs[i].grow = 1;
+    dumpfile(&s, &batch->outs[i]);
+    batch->failed[i] = s.failed;
+    inputfree(&s);
+}
+
+/* Dump each of the input files separately, each with its own header
+ * and starting from position zero (and each subject to --start and
+ * --limit). Consecutive small regular files are gathered into
+ * batches, which are dumped concurrently by the worker threads, each
+ * file into its own buffer, and then output in order. A file of a
+ * batch that had errors is dumped again by itself in its place, as
+ * are files that cannot be batched, so that errors are reported in
+ * order.
+ */
+static void dumpseparate(state *s)
+{
+    chd_context  *ctx = s->ctx;
+    separatebatch batch;
+    workpool      pool;
+    struct stat   st;
+    char        **filenames;
+    long long     size;
+    int           n, i;
+
+    poolstart(&pool, ctx->jobs);
+    batch.settings = s;
+    batch.outs = malloc(ctx->jobs * batchsize * sizeof *batch.outs);
+    batch.failed = malloc(ctx->jobs * batchsize * sizeof *batch.failed);
+    if (!batch.outs || !batch.failed)
+	die("out of memory");
+    filenames = s->filenames;
+    while (*filenames) {
+	size = 0;
+	for (n = 0 ; filenames[n] && n < ctx->jobs * batchsize ; ++n) {
+	    if (!strcmp(filenames[n], "-") || stat(filenames[n], &st)
+					   || !S_ISREG(st.st_mode)
+					   || st.st_size > chunksize
+					   || size >= (long long)ctx->jobs * chunksize)
+		break;
+	    size += st.st_size;
+	}
+	if (n) {
+	    batch.filenames = filenames;
+	    poolrun(&pool, separatejob, &batch, n);
+	    for (i = 0 ; i < n ; ++i) {
+		if (batch.failed[i])
+		    dumpalone(s, filenames[i]);
+		else
+		    outputflush(&batch.outs[i]);
+		free(batch.outs[i].buf);
+	    }
+	    filenames += n;
+	    continue;
+	}
+	dumpalone(s, *filenames++);
+    }
+    free(batch.failed);
+    free(batch.outs);
+    poolstop(&pool);
+}
+
+/* Input dump lines and turn them into character output, or into a
+ * dump in the requested format. Binary dumps are recognized by their
+ * signature.
+ */
+static void undump(state *s)
+{
+    chd_context *ctx = s->ctx;
+    output       out;
+    dumptarget   target;
+    dumpsource   src;
+    binparser    bp;
+    char       **file;
+    wchar_t     *line;
+    int          len, n;
+
+    len = undumplinelen(ctx);
+    line = arenaalloc(&s->lines, len * sizeof *line);
+    outputalloc(&out, ctx);
+    targetalloc(&target, ctx, &s->lines);
+    targetinit(&target, &out, ctx->outputformat);
+    binparserinit(&bp, ctx, NULL);
+    file = NULL;
+    for (;;) {
+	if (!s->charpos && !s->blockpos && ctx->outputformat == formatchars
+			&& canparallel(s) && !s->binary
+			&& codecunit(s->codec) == 1) {
+	    if (bp.filename)
+		binparserend(&bp);
+	    binparserinit(&bp, ctx, NULL);
+	    undumpparallel(s, &out, line, len);
+	    break;
+	}
+	if (s->maxinputlen <= 0 || !fillchars(s))
+	    break;
+	if (s->filenames != file) {
+	    if (bp.filename)
+		binparserend(&bp);
+	    file = s->filenames;
+	    src.filename = *file;
+	    src.lineno = 0;
+	    src.midline = 0;
+	    target.lastcount = 0;
+	    target.repeating = 0;
+	    binparserinit(&bp, ctx, s->binary ? *file : NULL);
+	}
+	if (s->binary) {
+	    n = s->charcount - s->charpos;
+	    s->maxinputlen -= parsebin(&bp, s->chars + s->charpos, n,
+				       &target, s->maxinputlen);
+	    s->charpos += n;
+	    continue;
+	}
+	n = nextwline(s, line, len);
+	if (!src.midline)
+	    addstat(ctx, statlinesparsed, 1);
+	s->maxinputlen -= undumpline(&target, line, n, s->maxinputlen, &src);
+    }
+    if (bp.filename && s->maxinputlen > 0)
+	binparserend(&bp);
+    emitend(&target);
+    outputflush(&out);
+    free(out.buf);
+}
+
+/* Output the bytes of the input that encode the characters selected
+ * by --start and --limit, unchanged. The characters are located using
+ * the index or by seeking where possible, and by decoding otherwise.
+ * The bytes of a regular file are then copied without being buffered.
+ */
+static void extract(state *s)
+{
+    struct stat st;
+    long long   skip, chars, bytes, total, filechars, n;
+    off_t       from, to;
+    int         seekable, truncated;
+
+    skip = s->startoffset;
+    while (s->maxinputlen > 0 && inputinit(s)) {
+	detectstart(s);
+	seekable = !fstat(s->currentfd, &st) && S_ISREG(st.st_mode);
+	filechars = 0;
+	if (skip) {
+	    n = seekinput(s, skip);
+	    skip -= n;
+	    if (s->currentfd < 0)
+		continue;
+	    filechars = n;
+	}
+	from = s->readpos;
+	n = scanchars(s, seekable, &from, skip, 0);
+	skip -= n;
+	filechars += n;
+	if (skip || s->inputerr) {
+	    inputupdate(s);
+	    continue;
+	}
+
+	if (!seekable) {
+	    s->maxinputlen -= scanchars(s, 0, &from, s->maxinputlen, 1);
+	    if (s->maxinputlen > 0 || s->inputerr)
+		inputupdate(s);
+	    continue;
+	}
+	to = from;
+	n = 0;
+	total = lookupinput(s, &st, s->maxinputlen < LLONG_MAX - filechars ?
+				    filechars + s->maxinputlen : LLONG_MAX,
+			    &chars, &bytes, &truncated);
+	if (total >= 0 && !truncated && total - filechars <= s->maxinputlen) {
+	    to = st.st_size;
+	    n = total - filechars;
+	} else {
+	    if (total >= 0 && chars > filechars) {
+		to = bytes;
+		n = chars - filechars;
+		memset(&s->mbs, 0, sizeof s->mbs);
+	    }
+	    n += scanchars(s, 1, &to, s->maxinputlen - n, 0);
+	}
+	copyrange(s, from, to);
+	s->maxinputlen -= n;
+	if (s->maxinputlen > 0 || s->inputerr)
+	    inputupdate(s);
+    }
+}
+
+/* Count how often each character occurs in the input, without
+ * rendering a dump, and output the histogram. The input is counted in
+ * parallel where it could be dumped in parallel.
+ */
+static void scan(state *s)
+{
+    histogram h;
+    output    out;
+    long long pos;
+    int       n;
+
+    memset(&h, 0, sizeof h);
+    if (skipinput(s, s->startoffset) == s->startoffset) {
+	pos = s->startoffset;
+	if (s->maxinputlen >= chunksize && canparallel(s))
+	    pos = scanparallel(s, &h, pos);
+	while (s->maxinputlen > 0 && fillchars(s)) {
+	    n = s->charcount - s->charpos;
+	    if (n > s->maxinputlen)
+		n = s->maxinputlen;
+	    countchars(&h, s->chars + s->charpos, n, pos);
+	    s->charpos += n;
+	    s->maxinputlen -= n;
+	    pos += n;
+	}
+    }
+    outputalloc(&out, s->ctx);
+    renderhistogram(&out, &h);
+    outputflush(&out);
+    free(out.buf);
+    freehistogram(&h);
+}
+
+/* Create an index file for each of the named input files, recording
+ * the byte offset of the first character in each block of input.
+ */
+static void buildindex(state *s)
+{
+    char        *onefile[2];
+    struct stat  st;
+    charindex    ix;
+    char       **filenames;
+    long long    total, last;
+    int          size;
+
+    for (filenames = s->filenames ; *filenames ; ++filenames) {
+	if (!strcmp(*filenames, "-")) {
+	    fputs("chd: cannot index standard input\n", stderr);
+	    s->ctx->exitcode = EXIT_FAILURE;
+	    continue;
+	}
+	if (stat(*filenames, &st)) {
+	    perror(*filenames);
+	    s->ctx->exitcode = EXIT_FAILURE;
+	    continue;
+	}
+	onefile[0] = *filenames;
+	s->filenames = onefile;
+	s->inputerr = -1;
+	ix.count = 0;
+	ix.entries = NULL;
+	size = 0;
+	total = last = 0;
+	while (fillchars(s)) {
+	    if (s->unpack) {
+		fprintf(stderr, "chd: %s: cannot index a compressed file\n",
+			*filenames);
+		s->ctx->exitcode = EXIT_FAILURE;
+		inputrelease(s);
+		close(s->currentfd);
+		s->currentfd = -1;
+		s->inputerr = -1;
+		break;
+	    }
+	    if (s->blockinit && total - last >= indexinterval) {
+		if (ix.count == size) {
+		    size = size ? 2 * size : 256;
+		    ix.entries = realloc(ix.entries, size * sizeof *ix.entries);
+		    if (!ix.entries)
+			die("out of memory");
+		}
+		ix.entries[ix.count].charpos = total;
+		ix.entries[ix.count].bytepos = s->blockpos;
+		++ix.count;
+		last = total;
+	    }
+	    total += s->charcount - s->charpos;
+	    s->charpos = s->charcount;
+	}
+	if (s->inputerr == 0 || s->inputerr == EILSEQ) {
+	    ix.totalchars = total;
+	    ix.truncated = s->inputerr == EILSEQ;
+	    saveindex(s->ctx, *filenames, &st, &ix);
+	}
+	free(ix.entries);
+    }
+}
+
+/* Find the first occurrence of the len characters at text in the
+ * input, after skipping the state's startoffset characters. The input
+ * is scanned once, without going back, by the Knuth-Morris-Pratt
+ * method. The return value is the offset of the occurrence, or -1 if
+ * there is none.
+ */
+static long long search(state *s, wchar_t const *text, int len)
+{
+    wchar_t const *p;
+    long long      pos;
+    int           *next;
+    int            i, k, n;
+
+    next = malloc(len * sizeof *next);
+    if (!next)
+	die("out of memory");
+    next[0] = 0;
+    for (i = 1, k = 0 ; i < len ; ++i) {
+	while (k && text[i] != text[k])
+	    k = next[k - 1];
+	if (text[i] == text[k])
+	    ++k;
+	next[i] = k;
+    }
+
+    pos = -1;
+    if (skipinput(s, s->startoffset) < s->startoffset)
+	goto done;
+    pos = s->startoffset;
+    k = 0;
+    while (fillchars(s)) {
+	n = s->charcount - s->charpos;
+	for (i = 0 ; i < n ; ++i) {
+	    p = s->chars + s->charpos + i;
+	    if (!k) {
+		p = wmemchr(p, text[0], n - i);
+		if (!p)
+		    break;
+		i = p - (s->chars + s->charpos);
+	    }
+	    while (k && *p != text[k])
+		k = next[k - 1];
+	    if (*p == text[k])
+		++k;
+	    if (k == len) {
+		pos += i + 1 - len;
+		goto done;
+	    }
+	}
+	pos += n;
+	s->charpos = s->charcount;
+    }
+    pos = -1;
+
+  done:
+    free(next);
+    return pos;
+}
+
+/* Return the number of characters in the first input file, if it can
+ * be determined without decoding the file, or -1 otherwise.
+ */
+static long long filelength(state *s)
+{
+    struct stat st;
+    long long   chars, bytes;
+    int         truncated;
+
+    if (!inputinit(s))
+	return -1;
+    detectstart(s);
+    if (s->readpos || s->bytecount || fstat(s->currentfd, &st)
+		   || !S_ISREG(st.st_mode))
+	return -1;
+    return lookupinput(s, &st, LLONG_MAX, &chars, &bytes, &truncated);
+}
+
+/* Prepare to perform an operation on the input described by the
+ * state, whose filenames (and memory or reader, if any) and range are
+ * filled in, under the context's settings.
+ */
+static void runstart(chd_context *ctx, state *s, int operation)
+{
+    s->ctx = ctx;
+    s->currentfd = -1;
+    s->map = NULL;
+    s->ahead = NULL;
+    s->unpack = NULL;
+    s->watchfd = -1;
+    s->waitms = -1;
+    s->injob = 0;
+    if (ctx->format != CHD_FORMAT_DEFAULT)
+	ctx->outputformat = ctx->format;
+    else
+	ctx->outputformat = operation == CHD_UNDUMP ? formatchars : formattext;
+    ctx->detectbinary = operation == CHD_UNDUMP;
+    ctx->exitcode = 0;
+    ctx->writefailed = 0;
+    inputalloc(s);
+}
+
+/* Finish an operation. A file left open when the operation stopped is
+ * closed without being reported. The return value is zero if no
+ * errors occurred, or -1 otherwise.
+ */
+static int runfinish(chd_context *ctx, state *s)
+{
+    if (s->currentfd != -1) {
+	inputrelease(s);
+	if (s->currentfd >= 0 && s->currentfd != STDIN_FILENO)
+	    close(s->currentfd);
+    }
+    inputfree(s);
+    flushoutput(ctx);
+    return ctx->exitcode || ctx->writefailed ? -1 : 0;
+}
+
+/* Perform an operation on the input described by the state.
+ */
+static int run(chd_context *ctx, state *s, int operation)
+{
+    runstart(ctx, s, operation);
+    if (operation == CHD_DUMP && ctx->separatefiles
+			      && !s->memory && !s->reader)
+	dumpseparate(s);
+    else if (operation == CHD_DUMP)
+	dump(s);
+    else if (operation == CHD_UNDUMP)
+	undump(s);
+    else if (operation == CHD_EXTRACT)
+	extract(s);
+    else if (operation == CHD_SCAN)
+	scan(s);
+    else
+	buildindex(s);
+    return runfinish(ctx, s);
+}
+
+/* Perform an operation on input that is not from a file: the size
+ * bytes at memory, or else the bytes supplied by reader. The input is
+ * named in error messages as if it were a file.
+ */
+static int runinput(chd_context *ctx, int operation, char const *memory,
+		    size_t size, chd_readfn *reader, void *arg)
+{
+    state s;
+    char *filenames[2];
+
+    memset(&s, 0, sizeof s);
+    filenames[0] = reader ? "(stream)" : "(memory)";
+    filenames[1] = NULL;
+    s.filenames = filenames;
+    if (reader) {
+	s.reader = reader;
+	s.readerarg = arg;
+    } else {
+	s.memory = memory ? memory : "";
+	s.memorysize = size;
+    }
+    s.startoffset = ctx->startoffset;
+    s.maxinputlen = ctx->maxinputlen;
+    return run(ctx, &s, operation);
+}
+
+/*
+ * The library interface.
+ */
+
+/* Fill in the default settings.
+ */
+void chd_defaults(chd_options *opts)
+{
+    memset(opts, 0, sizeof *opts);
+    opts->count = 8;
+    opts->format = CHD_FORMAT_DEFAULT;
+    opts->jobs = 1;
+    opts->latency = 200;
+    opts->usemmap = 1;
+    opts->decompress = 1;
+    opts->start = 0;
+    opts->limit = LLONG_MAX;
+}
+
+/* Create a context. The vectorized functions are selected the first
+ * time, and the encoding of the current locale is examined each time,
+ * as is the input encoding, if one is named.
+ */
+chd_context *chd_new(chd_options const *opts)
+{
+    static pthread_once_t kernelsonce = PTHREAD_ONCE_INIT;
+    chd_context *ctx;
+    long         n;
+    int          i;
+
+    if (opts->count < 1 || opts->count > CHD_MAXCOUNT || opts->jobs < 0
+			|| opts->latency < 0 || opts->start < 0
+			|| opts->limit < 0
+			|| (opts->format != CHD_FORMAT_DEFAULT
+				&& opts->format != CHD_FORMAT_TEXT
+				&& opts->format != CHD_FORMAT_BIN
+				&& opts->format != CHD_FORMAT_JSONL
+				&& opts->format != CHD_FORMAT_CSV)
+			|| ((opts->autoskip || opts->matchcount
+					    || opts->matchraw)
+				&& opts->format != CHD_FORMAT_DEFAULT
+				&& opts->format != CHD_FORMAT_TEXT)
+			|| (opts->separate
+				&& (opts->format == CHD_FORMAT_JSONL
+					|| opts->format == CHD_FORMAT_CSV))
+			|| opts->matchcount < 0 || opts->context < 0
+			|| ((opts->matchcount || opts->matchraw)
+				&& opts->autoskip)) {
+	errno = EINVAL;
+	return NULL;
+    }
+    for (i = 0 ; i < opts->matchcount ; ++i) {
+	if (opts->match[i].first < 0 || opts->match[i].last < opts->match[i].first
+				     || opts->match[i].last >= rawbyte) {
+	    errno = EINVAL;
+	    return NULL;
+	}
+    }
+    ctx = calloc(1, sizeof *ctx);
+    if (!ctx)
+	return NULL;
+    if (opts->matchcount || opts->matchraw) {
+	ctx->match = malloc((opts->matchcount + 1) * sizeof *ctx->match);
+	if (!ctx->match) {
+	    free(ctx);
+	    return NULL;
+	}
+	for (i = 0 ; i < opts->matchcount ; ++i) {
+	    ctx->match[i].first = opts->match[i].first;
+	    ctx->match[i].span = opts->match[i].last - opts->match[i].first;
+	}
+	if (opts->matchraw) {
+	    ctx->match[i].first = rawbyte;
+	    ctx->match[i].span = 0xFF;
+	    ++i;
+	}
+	ctx->matchcount = i;
+	ctx->context = opts->context;
+    }
+    pthread_once(&kernelsonce, selectkernels);
+    ctx->linesize = opts->count;
+    ctx->acceptbadchars = opts->ignore;
+    ctx->format = opts->format;
+    ctx->autoskip = opts->autoskip;
+    ctx->separatefiles = opts->separate;
+    ctx->usemmap = opts->usemmap;
+    ctx->decompress = opts->decompress;
+    ctx->jobs = opts->jobs;
+    if (!ctx->jobs) {
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	ctx->jobs = n > 0 ? n : 1;
+    }
+    ctx->followinput = opts->follow;
+    ctx->latency = opts->latency;
+    ctx->showstats = opts->stats;
+    ctx->startoffset = opts->start;
+    ctx->maxinputlen = opts->limit;
+    ctx->utf8locale = !strcmp(nl_langinfo(CODESET), "UTF-8");
+    ctx->codec = ctx->utf8locale ? codecutf8 : codecmbs;
+    ctx->detectbom = ctx->utf8locale ? bomutf16 | bomutf32 : 0;
+    if (opts->encoding && !selectencoding(ctx, opts->encoding)) {
+	chd_free(ctx);
+	return NULL;
+    }
+    ctx->singlebyte = issinglebyte(ctx);
+    return ctx;
+}
+
+/* Free a context.
+ */
+void chd_free(chd_context *ctx)
+{
+    free(ctx->match);
+    free(ctx->encoding);
+    free(ctx);
+}
+
+/* Set the destination of the context's output.
+ */
+void chd_setoutput(chd_context *ctx, chd_writefn *writer, void *arg)
+{
+    ctx->writer = writer;
+    ctx->writerarg = arg;
+}
+
+/* Dump the bytes in memory.
+ */
+int chd_dump(chd_context *ctx, void const *buf, size_t size)
+{
+    return runinput(ctx, CHD_DUMP, buf, size, NULL, NULL);
+}
+
+/* Reverse the dump in memory.
+ */
+int chd_undump(chd_context *ctx, void const *buf, size_t size)
+{
+    return runinput(ctx, CHD_UNDUMP, buf, size, NULL, NULL);
+}
+
+/* Dump the bytes supplied by reader.
+ */
+int chd_dumpstream(chd_context *ctx, chd_readfn *reader, void *arg)
+{
+    return runinput(ctx, CHD_DUMP, NULL, 0, reader, arg);
+}
+
+/* Reverse the dump supplied by reader.
+ */
+int chd_undumpstream(chd_context *ctx, chd_readfn *reader, void *arg)
+{
+    return runinput(ctx, CHD_UNDUMP, NULL, 0, reader, arg);
+}
+
+/* Perform an operation on a list of files. Reading the files with
+ * --follow, or dumping them separately, is only possible for some
+ * operations.
+ */
+int chd_files(chd_context *ctx, int operation, char **filenames)
+{
+    state s;
+
+    if (operation < CHD_DUMP || operation > CHD_SCAN
+	    || (operation != CHD_DUMP && operation != CHD_UNDUMP
+		      && (ctx->followinput
+				|| ctx->format != CHD_FORMAT_DEFAULT))
+	    || (ctx->separatefiles
+		      && (operation != CHD_DUMP || ctx->followinput))
+	    || (ctx->matchcount && operation != CHD_DUMP)) {
+	errno = EINVAL;
+	return -1;
+    }
+    memset(&s, 0, sizeof s);
+    s.filenames = filenames;
+    s.startoffset = ctx->startoffset;
+    s.maxinputlen = ctx->maxinputlen;
+    return run(ctx, &s, operation);
+}
+
+/* Dump count characters of a file, starting start characters into
+ * it.
+ */
+int chd_dumprange(chd_context *ctx, char const *filename,
+		  long long start, long long count)
+{
+    state s;
+    char *filenames[2];
+
+    if (start < 0 || count < 0 || ctx->followinput) {
+	errno = EINVAL;
+	return -1;
+    }
+    memset(&s, 0, sizeof s);
+    filenames[0] = (char*)filename;
+    filenames[1] = NULL;
+    s.filenames = filenames;
+    s.startoffset = start;
+    s.maxinputlen = count;
+    return run(ctx, &s, CHD_DUMP);
+}
+
+/* Search a file for a string of characters.
+ */
+long long chd_search(chd_context *ctx, char const *filename, long long start,
+		     wchar_t const *text, size_t len)
+{
+    state     s;
+    char     *filenames[2];
+    long long pos;
+
+    if (start < 0 || !len || len > INT_MAX || ctx->followinput) {
+	errno = EINVAL;
+	return -1;
+    }
+    memset(&s, 0, sizeof s);
+    filenames[0] = (char*)filename;
+    filenames[1] = NULL;
+    s.filenames = filenames;
+    s.startoffset = start;
+    s.maxinputlen = LLONG_MAX;
+    runstart(ctx, &s, CHD_DUMP);
+    pos = search(&s, text, len);
+    runfinish(ctx, &s);
+    return pos;
+}
+
+/* Find the length of a file in characters, where this is possible
+ * without decoding it.
+ */
+long long chd_length(chd_context *ctx, char const *filename)
+{
+    state     s;
+    char     *filenames[2];
+    long long n;
+
+    memset(&s, 0, sizeof s);
+    filenames[0] = (char*)filename;
+    filenames[1] = NULL;
+    s.filenames = filenames;
+    runstart(ctx, &s, CHD_DUMP);
+    n = filelength(&s);
+    runfinish(ctx, &s);
+    return n;
+}
+
+/* Display the statistics gathered so far. Times spent in worker
+ * threads are summed, so they can exceed the elapsed time.
+ */
+void chd_printstats(chd_context *ctx, FILE *fp)
+{
+    static char const *names[statcount] = {
+	"bytes read", "characters decoded", "raw bytes", "lines rendered",
+	"lines parsed", "bytes written",
+	"input time", "decode time", "format time", "output time"
+    };
+    int i;
+
+    for (i = 0 ; i < stattimeinput ; ++i)
+	fprintf(fp, "%-20s%14lld\n", names[i], ctx->stats[i]);
+    for ( ; i < statcount ; ++i)
+	fprintf(fp, "%-20s%14.6f s\n", names[i], ctx->stats[i] / 1e9);
+}